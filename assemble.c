@@ -15,8 +15,8 @@ static void Assemble(ParseContext *c, char *name);
 void ParseAsm(ParseContext *c)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeAsmStatement);
-    System *sys = c->sys;
-    uint8_t *start = sys->nextLow;
+    GenerateContext *g = c->g;
+    uint8_t *start = g->codeFree;
     int length;
     int tkn;
     
@@ -46,11 +46,13 @@ void ParseAsm(ParseContext *c)
         Assemble(c, c->token);
     }
     
-    /* store the code */
-    length = sys->nextLow - start;
-    node->u.asmStatement.code = start;
+    /* move the code out of the image buffer until the statement is generated */
+    length = g->codeFree - start;
+    node->u.asmStatement.code = (uint8_t *)AllocateHighMemory(c->sys, length, HEAP_NODES);
+    memcpy(node->u.asmStatement.code, start, length);
     node->u.asmStatement.length = length;
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    g->codeFree = start;
+    AddNodeToList(c, node);
     
     /* check for the end of the 'END ASM' statement */
     FRequire(c, T_EOL);
@@ -0,0 +1,246 @@
+/* cache.c - on-disk compile cache
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ * A cache entry is keyed by a hash of the compiler identification and the main source.
+ * It consists of the compiled image and a dependency file that lists the included files
+ * along with hashes of their contents. An entry is only used if none of them have changed.
+ *
+ * When the whole program misses, each function definition in the main source can still be
+ * found in the cache as a relocatable fragment. A fragment is keyed by the source lines of the
+ * function and the names and storage classes of the global symbols defined before it, since
+ * those are all that its code depends on.
+ *
+ * Each cache file is written under a temporary name and renamed into place when it is
+ * complete so a reader never sees a partial file, even from a job running at the same time.
+ *
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "compile.h"
+
+#ifdef COMPILE_CACHE
+
+/* the compiler is identified by its build time since all sources are compiled together */
+#define COMPILER_ID     "junkbasic " __DATE__ " " __TIME__
+
+/* FNV-1a hash parameters */
+#define FNV_OFFSET      0xcbf29ce484222325ULL
+#define FNV_PRIME       0x100000001b3ULL
+
+/* local function prototypes */
+static int HashFile(const char *name, CacheHash *pHash);
+static void CachePath(char *path, CacheHash key, const char *ext);
+static void TempPath(char *temp, const char *path);
+static int CommitCacheFile(const char *temp, const char *path, int sts);
+static CacheHash HashGlobals(ParseContext *c);
+
+/* HashInit - start a cache key hash with the compiler identification */
+CacheHash HashInit(void)
+{
+    return HashBytes(FNV_OFFSET, COMPILER_ID, strlen(COMPILER_ID));
+}
+
+/* HashBytes - add bytes to a hash */
+CacheHash HashBytes(CacheHash hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (size-- > 0) {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* FindCachedImage - map a cached image if none of its dependencies have changed */
+uint8_t *FindCachedImage(System *sys, CacheHash key)
+{
+    char path[FILENAME_MAX], line[FILENAME_MAX + 32], *name, *p;
+    CacheHash hash;
+    VMFILE *fp;
+    int valid;
+
+    /* open the dependency file */
+    CachePath(path, key, ".dep");
+    if (!(fp = VM_fopen(path, "r")))
+        return NULL;
+
+    /* check the compiler identification */
+    valid = VM_fgets(line, sizeof(line), fp) != NULL
+         && strncmp(line, COMPILER_ID, strlen(COMPILER_ID)) == 0;
+
+    /* check the hash of each included file */
+    while (valid && VM_fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strchr(line, '\n')) != NULL)
+            *p = '\0';
+        if (!(name = strchr(line, ' ')))
+            valid = VMFALSE;
+        else {
+            *name++ = '\0';
+            valid = HashFile(name, &hash) && hash == (CacheHash)strtoull(line, NULL, 16);
+        }
+    }
+    VM_fclose(fp);
+
+    /* map the image if it is still valid */
+    if (!valid)
+        return NULL;
+    CachePath(path, key, ".img");
+    return MapImage(sys, path);
+}
+
+/* CacheImage - add a compiled image and its dependencies to the cache */
+void CacheImage(ParseContext *c, CacheHash key, uint8_t *image)
+{
+    char path[FILENAME_MAX], temp[FILENAME_MAX + 32], line[FILENAME_MAX + 32];
+    IncludedFile *inc;
+    CacheHash hash;
+    VMFILE *fp;
+    int sts;
+
+    /* remove the old dependencies so the entry can't be used until it is complete */
+    VM_mkdir(CACHE_DIR);
+    CachePath(path, key, ".dep");
+    VM_remove(path);
+
+    /* store the image */
+    CachePath(path, key, ".img");
+    TempPath(temp, path);
+    if (!CommitCacheFile(temp, path, SaveImage(temp, image)))
+        return;
+
+    /* store the dependencies (without them the entry is never used) */
+    CachePath(path, key, ".dep");
+    TempPath(temp, path);
+    if (!(fp = VM_fopen(temp, "w")))
+        return;
+    sts = VM_fputs(COMPILER_ID "\n", fp) >= 0;
+    for (inc = c->includedFiles; sts && inc != NULL; inc = inc->next) {
+        if (!(sts = HashFile(inc->name, &hash)))
+            break;
+        sprintf(line, "%016llx %s\n", (unsigned long long)hash, inc->name);
+        sts = VM_fputs(line, fp) >= 0;
+    }
+    sts = VM_fclose(fp) == 0 && sts;
+    CommitCacheFile(temp, path, sts);
+}
+
+/* LinkCachedFunction - link the cached fragment for a function definition and skip its source */
+int LinkCachedFunction(ParseContext *c)
+{
+    char path[FILENAME_MAX];
+    FunctionRange *range;
+    CacheHash globals;
+    VMFILE *fp;
+
+    /* only function definitions in the main source are cached */
+    c->cacheFragment = VMFALSE;
+    if (c->currentFile)
+        return VMFALSE;
+    for (range = c->functionRanges; range != NULL; range = range->next)
+        if (range->startLine == c->lineNumber)
+            break;
+    if (!range)
+        return VMFALSE;
+
+    /* build the fragment key */
+    globals = HashGlobals(c);
+    c->fragmentKey = HashBytes(range->hash, &globals, sizeof(globals));
+
+    /* save the fragment when the function is complete if it isn't in the cache */
+    CachePath(path, c->fragmentKey, ".obj");
+    if (!(fp = VM_fopen(path, "rb"))) {
+        c->cacheFragment = VMTRUE;
+        return VMFALSE;
+    }
+    VM_fclose(fp);
+
+    /* link the fragment and skip over the function definition */
+    LinkObject(c, path);
+    while (c->lineNumber < range->endLine && ParseGetLine(c))
+        ;
+    c->sys->linePtr = c->sys->lineStart + strlen(c->sys->lineStart);
+
+    return VMTRUE;
+}
+
+/* CacheFunction - save the function that was just generated as a fragment */
+void CacheFunction(ParseContext *c)
+{
+    char path[FILENAME_MAX], temp[FILENAME_MAX + 32];
+    Fragment fragment;
+    int sts;
+
+    if (!c->cacheFragment)
+        return;
+    c->cacheFragment = VMFALSE;
+
+    GenerateFragment(c->g, c->currentFunction, &fragment);
+    VM_mkdir(CACHE_DIR);
+    CachePath(path, c->fragmentKey, ".obj");
+    TempPath(temp, path);
+    sts = WriteFragment(c, temp, c->currentFunction->u.functionDefinition.symbol, &fragment);
+    CommitCacheFile(temp, path, sts);
+    DiscardFragment(c->g, &fragment);
+}
+
+/* HashGlobals - hash the names and storage classes of the global symbols (in any order) */
+static CacheHash HashGlobals(ParseContext *c)
+{
+    CacheHash sum = 0;
+    Symbol *symbol;
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        CacheHash hash = FNV_OFFSET;
+        uint8_t storageClass = symbol->storageClass;
+        char *p;
+        for (p = symbol->name; *p != '\0'; ++p) {
+            uint8_t ch = tolower((uint8_t)*p);
+            hash = HashBytes(hash, &ch, 1);
+        }
+        sum += HashBytes(hash, &storageClass, 1);
+    }
+    return sum;
+}
+
+/* HashFile - hash the contents of a file */
+static int HashFile(const char *name, CacheHash *pHash)
+{
+    uint8_t buf[512];
+    size_t count;
+    VMFILE *fp;
+
+    if (!(fp = VM_fopen(name, "rb")))
+        return VMFALSE;
+
+    *pHash = FNV_OFFSET;
+    while ((count = VM_fread(buf, 1, sizeof(buf), fp)) > 0)
+        *pHash = HashBytes(*pHash, buf, count);
+    VM_fclose(fp);
+
+    return VMTRUE;
+}
+
+/* CachePath - build the path to a cache file */
+static void CachePath(char *path, CacheHash key, const char *ext)
+{
+    sprintf(path, "%s/%016llx%s", CACHE_DIR, (unsigned long long)key, ext);
+}
+
+/* TempPath - build the temporary path a cache file is written to (unique to this process) */
+static void TempPath(char *temp, const char *path)
+{
+    sprintf(temp, "%s.%ld.tmp", path, (long)getpid());
+}
+
+/* CommitCacheFile - rename a temporary file into place if it was written successfully or remove it */
+static int CommitCacheFile(const char *temp, const char *path, int sts)
+{
+    if (sts && VM_rename(temp, path) == 0)
+        return VMTRUE;
+    VM_remove(temp);
+    return VMFALSE;
+}
+
+#endif
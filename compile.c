@@ -8,6 +8,13 @@
 #include "compile.h"
 #include "vmint.h"
 
+/* local function prototypes */
+static void BuildImage(ParseContext *c, VMVALUE mainCode);
+static void StoreSymbols(ParseContext *c, uint8_t *p);
+static void ParseProgram(ParseContext *c);
+static ObjectHdr *CompileModule(ParseContext *c);
+static uint8_t *LoadImage(ParseContext *c);
+
 /* InitCompileContext - initialize the compile (parse) context */
 ParseContext *InitCompileContext(System *sys)
 {
@@ -19,98 +26,328 @@ ParseContext *InitCompileContext(System *sys)
     return c;
 }
        
-/* Compile - parse a program */
-void Compile(ParseContext *c)
+/* Compile - compile a program and load its image ready to execute */
+uint8_t *Compile(ParseContext *c)
 {
     VMVALUE mainCode;
-    Interpreter *i;
-    Symbol *symbol;
+    uint8_t *image;
+    Phase phase;
+    
+    /* setup an error target */
+    if (setjmp(c->sys->errorTarget) != 0)
+        return NULL;
+        
+    /* parse the program */
+    ParseProgram(c);
+    
+    /* implicit variables may only be assigned in functions that haven't been parsed */
+    if (c->lazy)
+        ResolveImplicitGlobals(c);
+    
+    /* generate the rest of the main function */
+    mainCode = EndMain(c->g, c->mainFunction);
+    
+    /* place the strings and data and build the image */
+    EnterPhase(c->sys, PHASE_LINK);
+    BuildImage(c, mainCode);
+
+    /* the time spent on the dumps isn't charged to linking */
+    if (c->sys->diagnostics >= DIAG_DUMP) {
+        phase = EnterPhase(c->sys, PHASE_DIAGNOSTICS);
+        DumpFunctions(c->g);
+        DumpConstants(c->g);
+        DumpSymbols(&c->globals, "Globals");
+        DumpStrings(c);
+        ReportHeapUsage(c->sys, "after compile");
+        EnterPhase(c->sys, phase);
+    }
+    
+    /* load the image */
+    image = LoadImage(c);
+    if (c->sys->diagnostics >= DIAG_TIMING)
+        ReportTiming(c->sys, "after compile");
+    return image;
+}
+
+/* CompileObject - compile a module of declarations and functions to a relocatable object module */
+int CompileObject(ParseContext *c, const char *name)
+{
+    /* setup an error target */
+    if (setjmp(c->sys->errorTarget) != 0)
+        return VMFALSE;
+        
+    /* write the object module */
+    WriteObject(c, CompileModule(c), name);
+    if (c->sys->diagnostics >= DIAG_TIMING)
+        ReportTiming(c->sys, "after compile");
+    
+    return VMTRUE;
+}
+
+/* CompileObjectModule - compile a module of declarations and functions to a relocatable object module in memory */
+/* (the object module is in high memory and NULL is returned if the module doesn't compile) */
+ObjectHdr *CompileObjectModule(ParseContext *c)
+{
+    ObjectHdr *hdr;
     
     /* setup an error target */
     if (setjmp(c->sys->errorTarget) != 0)
-        return;
+        return NULL;
+        
+    hdr = CompileModule(c);
+    if (c->sys->diagnostics >= DIAG_TIMING)
+        ReportTiming(c->sys, "after compile");
+    
+    return hdr;
+}
+
+/* CompileModule - parse a module and build its object module */
+static ObjectHdr *CompileModule(ParseContext *c)
+{
+    Phase phase;
+    
+    /* references to symbols and strings are left on fixup chains for the linker */
+    c->g->relocatable = VMTRUE;
+    
+    /* parse the module */
+    ParseProgram(c);
+    
+    /* there is no main code in an object module */
+    if (c->mainFunction->u.functionDefinition.bodyStatements)
+        Abort(c->sys, "object modules can only contain declarations and functions");
         
+    /* the time spent on the dumps isn't charged to parsing */
+    if (c->sys->diagnostics >= DIAG_DUMP) {
+        phase = EnterPhase(c->sys, PHASE_DIAGNOSTICS);
+        DumpFunctions(c->g);
+        DumpSymbols(&c->globals, "Globals");
+        DumpStrings(c);
+        ReportHeapUsage(c->sys, "after compile");
+        EnterPhase(c->sys, phase);
+    }
+    
+    /* build the object module */
+    EnterPhase(c->sys, PHASE_LINK);
+    return BuildObject(c);
+}
+
+/* ParseProgram - parse the main source file */
+static void ParseProgram(ParseContext *c)
+{
     /* initialize the string table */
     c->strings = NULL;
+    c->stringBuckets = (String **)AllocateHighMemory(c->sys, STRINGBUCKETS * sizeof(String *), HEAP_STRINGS);
+    memset(c->stringBuckets, 0, STRINGBUCKETS * sizeof(String *));
+
+    /* initialize the global data list */
+    c->dataBlocks = NULL;
+    c->pNextDataBlock = &c->dataBlocks;
 
     /* initialize block nesting table */
     c->btop = (Block *)((char *)c->blockBuf + sizeof(c->blockBuf));
     c->bptr = &c->blockBuf[0] - 1;
+    c->nodeStack.next = NULL;
+    c->nodeChunk = &c->nodeStack;
+    c->nodeChunkBase = 0;
+    c->nodeCount = 0;
 
     /* create the main function */
     c->mainFunction = StartFunction(c, NULL);
     
     /* initialize the global symbol table */
-    InitSymbolTable(&c->globals);
+    InitSymbolTable(c, &c->globals, GLOBALBUCKETS);
     
     /* initialize scanner */
     InitScan(c);
     
+    /* read the main program from its file like an include file */
+    if (c->mainFile && !PushFile(c, c->mainFile))
+        Abort(c->sys, "can't open '%s'", c->mainFile);
+    
+    /* parse trees are released back to here once their code is generated */
+    MarkHeap(c->sys, &c->treeMark);
+    
     /* parse the program */
     while (ParseGetLine(c)) {
         int tkn;
-        if ((tkn = GetToken(c)) != T_EOL)
+        if ((tkn = GetToken(c)) != T_EOL) {
             ParseStatement(c, tkn);
+            FlushMain(c);
+        }
+    }
+    
+    /* make sure every block was closed */
+    if (c->bptr != &c->blockBuf[0])
+        ParseError(c, "unexpected end of file in a block");
+        
+    /* end the main statement list (only an object module has statements left) */
+    EndStatementList(c);
+}
+
+/* BuildImage - place the strings and data after the code and fill in the image header */
+static void BuildImage(ParseContext *c, VMVALUE mainCode)
+{
+    GenerateContext *g = c->g;
+    ImageHdr *hdr = (ImageHdr *)g->codeBuf;
+    VMUVALUE bssOffset, symbolsSize;
+    DataBlock *data;
+    Symbol *symbol;
+    String *str;
+    
+    /* make sure all functions have been defined */
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        if (symbol->storageClass == SC_FUNCTION && !symbol->placed)
+            Abort(c->sys, "undefined function: %s", symbol->name);
+    }
+    
+    /* identify the image */
+    hdr->magic = IMAGE_MAGIC;
+    hdr->version = IMAGE_VERSION;
+    hdr->wordSize = sizeof(VMVALUE);
+    
+    /* the code segment is everything generated so far */
+    hdr->entry = mainCode;
+    hdr->codeOffset = sizeof(ImageHdr);
+    hdr->codeSize = codeaddr(g) - hdr->codeOffset;
+    
+    /* place the read-only strings */
+    hdr->stringsOffset = codeaddr(g);
+    for (str = c->strings; str != NULL; str = str->next)
+        PlaceString(g, str, StoreByteVector(g, (uint8_t *)str->data, str->length + 1));
+    hdr->stringsSize = codeaddr(g) - hdr->stringsOffset;
+    
+    /* place the initialized data */
+    hdr->dataOffset = alignaddr(g);
+    for (data = c->dataBlocks; data != NULL; data = data->next) {
+        if (data->initializers)
+            PlaceSymbol(g, data->symbol, StoreVector(g, data->initializers, data->size));
     }
+    hdr->dataSize = codeaddr(g) - hdr->dataOffset;
     
-    PrintNode(c->mainFunction, 0);
+    /* store the line table */
+    hdr->linesOffset = StoreLines(g);
+    hdr->lineCount = g->lineCount;
     
-    /* generate code for the main function */
-    mainCode = Generate(c->g, c->mainFunction);
+    /* reserve space for the symbol export table and the constant pool */
+    /* they are filled in after the bss has been placed */
+    symbolsSize = 0;
+    hdr->symbolCount = 0;
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        if (symbol->storageClass != SC_UNKNOWN) {
+            symbolsSize += ImageSymbolSize(strlen(symbol->name));
+            ++hdr->symbolCount;
+        }
+    }
+    hdr->symbolsOffset = ReserveSpace(g, symbolsSize);
+    hdr->constantsOffset = ReserveSpace(g, g->constantCount * sizeof(VMVALUE));
+    hdr->constantCount = g->constantCount;
+    hdr->imageSize = codeaddr(g);
     
-    /* store all implicitly declared global variables */
+    /* place the zero-initialized data including implicitly declared variables */
+    bssOffset = hdr->imageSize;
+    for (data = c->dataBlocks; data != NULL; data = data->next) {
+        if (!data->initializers) {
+            PlaceSymbol(g, data->symbol, bssOffset);
+            bssOffset += data->size * sizeof(VMVALUE);
+        }
+    }
     for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
         if (symbol->storageClass == SC_VARIABLE && !symbol->placed) {
-            VMVALUE value = 0;
-            VMVALUE addr = StoreVector(c->g, &value, 1);
-            PlaceSymbol(c->g, symbol, addr);
+            PlaceSymbol(g, symbol, bssOffset);
+            bssOffset += sizeof(VMVALUE);
         }
     }
-
-    DumpFunctions(c->g);
-    DumpSymbols(&c->globals, "Globals");
-    DumpStrings(c);
+    hdr->bssSize = bssOffset - hdr->imageSize;
     
-    if (!(i = InitInterpreter(c->sys, c->g->codeBuf, 1024)))
-        VM_printf("insufficient memory");
-    else {
-        Execute(i, mainCode);
+    /* store the symbol export table and the constant pool now that everything has been placed */
+    StoreSymbols(c, g->codeBuf + hdr->symbolsOffset);
+    StoreConstants(g, hdr->constantsOffset);
+}
+
+/* StoreSymbols - store the symbol export table */
+static void StoreSymbols(ParseContext *c, uint8_t *p)
+{
+    Symbol *symbol;
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        ImageSymbol *export = (ImageSymbol *)p;
+        if (!(export->kind = ExportKind(symbol)))
+            continue;
+        export->value = symbol->value;
+        strcpy(export->name, symbol->name);
+        p += ImageSymbolSize(strlen(symbol->name));
     }
 }
 
-/* PushFile - push a file onto the input file stack */
-int PushFile(ParseContext *c, const char *name)
+/* LoadImage - load the image for execution and allocate its bss */
+static uint8_t *LoadImage(ParseContext *c)
 {
     System *sys = c->sys;
+    uint8_t *image = c->g->codeBuf;
+    ImageHdr *hdr = (ImageHdr *)image;
+    uint8_t *bss;
+    
+    /* functions compiled while the program runs need the compiler's data and go after the bss */
+    if (c->lazy) {
+        GenerateContext *g = c->g;
+        if (image + hdr->imageSize + hdr->bssSize > g->codeTop)
+            Abort(sys, "insufficient memory");
+        memset(image + hdr->imageSize, 0, hdr->bssSize);
+        g->codeFree = image + hdr->imageSize + hdr->bssSize;
+        g->runtime = VMTRUE;
+        return image;
+    }
+    
+    /* the image buffer is at the bottom of low memory and the rest of low memory is no longer needed */
+    ReleaseLowMemory(sys, &c->g->imageMark);
+    AllocateLowMemory(sys, hdr->imageSize, HEAP_CODE);
+    c->nodeStack.next = NULL;
+    c->nodeChunk = &c->nodeStack;
+    c->nodeChunkBase = 0;
+    
+    /* allocate the bss immediately after the image and clear it */
+    if (hdr->bssSize > 0) {
+        bss = (uint8_t *)AllocateLowMemory(sys, hdr->bssSize, HEAP_DATA);
+        memset(bss, 0, hdr->bssSize);
+    }
+    
+    /* return the loaded image */
+    return image;
+}
+
+/* AddIncludedFile - add a file to the list of included files (returns NULL if it was already included) */
+IncludedFile *AddIncludedFile(ParseContext *c, const char *name)
+{
     IncludedFile *inc;
-    ParseFile *f;
-    void *fp;
     
     /* check to see if the file has already been included */
     for (inc = c->includedFiles; inc != NULL; inc = inc->next)
         if (strcmp(name, inc->name) == 0)
-            return VMTRUE;
+            return NULL;
     
     /* add this file to the list of already included files */
-    if (!(inc = (IncludedFile *)AllocateHighMemory(sys, sizeof(IncludedFile) + strlen(name))))
-        Abort(sys, "insufficient memory");
+    if (!(inc = (IncludedFile *)AllocateHighMemory(c->sys, sizeof(IncludedFile) + strlen(name), HEAP_COMPILER)))
+        Abort(c->sys, "insufficient memory");
     strcpy(inc->name, name);
     inc->next = c->includedFiles;
     c->includedFiles = inc;
+    
+    return inc;
+}
+
+/* PushFile - push a file onto the input file stack */
+int PushFile(ParseContext *c, const char *name)
+{
+    IncludedFile *inc;
+    ParseFile *f;
+    
+    /* check to see if the file has already been included */
+    if (!(inc = AddIncludedFile(c, name)))
+        return VMTRUE;
 
     /* open the input file */
-    if (!(fp = VM_open(sys, name, "r")))
+    if (!(f = OpenParseFile(c, inc)))
         return VMFALSE;
     
-    /* allocate a parse file structure */
-    if (!(f = (ParseFile *)AllocateHighMemory(sys, sizeof(ParseFile))))
-        Abort(sys, "insufficient memory");
-    
-    /* initialize the parse file structure */
-    f->fp = fp;
-    f->file = inc;
-    f->lineNumber = 0;
-    
     /* push the file onto the input file stack */
     f->next = c->currentFile;
     c->currentFile = f;
@@ -139,26 +376,107 @@ int ParseGetLine(ParseContext *c)
         
         /* get a line from the current include file */
         else {
-            if (VM_getline(sys->lineBuf, sizeof(sys->lineBuf) - 1, f->fp)) {
-             	c->lineNumber = ++f->lineNumber;
-                sys->linePtr = sys->lineBuf;
+            if (ReadParseFile(sys, f)) {
+             	c->lineNumber = f->lineNumber;
+             	
+             	/* a #! line at the start of a file lets it be run as a script */
+             	if (f->lineNumber == 1 && sys->lineStart[0] == '#' && sys->lineStart[1] == '!')
+             	    continue;
                	break;
             }
             else {
                 c->currentFile = f->next;
-                VM_close(f->fp);
+                CloseParseFile(f);
             }
         }        
     }
     
-    /* make sure the line is correctly terminated */
-    len = strlen(sys->lineBuf);
-    if (len == 0 || sys->lineBuf[len - 1] != '\n') {
-        sys->lineBuf[len++] = '\n';
-        sys->lineBuf[len] = '\0';
+    /* make sure the line is correctly terminated (lines in mapped files already are) */
+    if (sys->lineStart == sys->lineBuf) {
+        len = strlen(sys->lineBuf);
+        if (len == 0 || sys->lineBuf[len - 1] != '\n') {
+            sys->lineBuf[len++] = '\n';
+            sys->lineBuf[len] = '\0';
+        }
     }
 
     /* return successfully */
     return VMTRUE;
 }
 
+/* OpenParseFile - open an included file to be parsed */
+/* (the file is mapped and scanned in place if possible so its lines can be any length) */
+ParseFile *OpenParseFile(ParseContext *c, IncludedFile *inc)
+{
+    System *sys = c->sys;
+    ParseFile *f;
+    
+    /* allocate a parse file structure */
+    if (!(f = (ParseFile *)AllocateHighMemory(sys, sizeof(ParseFile), HEAP_COMPILER)))
+        Abort(sys, "insufficient memory");
+    memset(f, 0, sizeof(ParseFile));
+    f->file = inc;
+    
+    /* map the file or, if that isn't possible, open it to be read a line at a time */
+    if ((f->text = VM_mapsource(inc->name, &f->size)) != NULL)
+        f->nextLine = f->text;
+    else if (!(f->fp = VM_open(sys, inc->name, "r")))
+        return NULL;
+        
+    /* return the parse file */
+    return f;
+}
+
+/* ReadParseFile - get the next line from a parse file */
+int ReadParseFile(System *sys, ParseFile *f)
+{
+    char *line, *end;
+    
+    /* read the next line into the line buffer */
+    if (!f->text) {
+        if (!VM_getline(sys->lineBuf, sizeof(sys->lineBuf) - 1, f->fp))
+            return VMFALSE;
+        sys->lineStart = sys->lineBuf;
+    }
+    
+    /* or terminate the next line of the mapped text in place */
+    else {
+        
+        /* restore the start of the line after the current one */
+        if (f->lineEnd)
+            *f->lineEnd = f->savedChar;
+            
+        /* check for the end of the file */
+        if ((line = f->nextLine) >= f->text + f->size)
+            return VMFALSE;
+            
+        /* find the end of the line (VM_mapsource leaves room to add a newline to the last one) */
+        if ((end = memchr(line, '\n', f->text + f->size - line)) != NULL)
+            ++end;
+        else {
+            end = f->text + f->size;
+            *end++ = '\n';
+        }
+        
+        /* terminate the line */
+        f->nextLine = f->lineEnd = end;
+        f->savedChar = *end;
+        *end = '\0';
+        sys->lineStart = line;
+    }
+    
+    /* return successfully */
+    sys->linePtr = sys->lineStart;
+    ++f->lineNumber;
+    return VMTRUE;
+}
+
+/* CloseParseFile - close a parse file */
+void CloseParseFile(ParseFile *f)
+{
+    if (f->text)
+        VM_unmapsource(f->text, f->size);
+    else
+        VM_close(f->fp);
+}
+
@@ -9,26 +9,55 @@
 
 #include <stdio.h>
 #include <setjmp.h>
+#include <ctype.h>
 #include "types.h"
 #include "image.h"
 #include "system.h"
 
 /* program limits */
 #define MAXTOKEN        32
+#define MAXCONSTANTS    256     /* must fit in the byte operand of OP_KLIT */
+#define CONSTANTBUCKETS 64      /* hash chains in the constant pool (a power of two) */
+#ifdef PROPELLER
+#define NODECHUNKSIZE   64      /* nodes in each chunk of the stack of lists being parsed */
+#define GLOBALBUCKETS   64      /* hash chains in the global symbol table (a power of two) */
+#define STRINGBUCKETS   32      /* hash chains in the string constant pool (a power of two) */
+#else
+#define NODECHUNKSIZE   1024
+#define GLOBALBUCKETS   1024
+#define STRINGBUCKETS   256
+#endif
+#define LOCALBUCKETS    16      /* hash chains in an argument or local symbol table (a power of two) */
+
+/* case-folded identifier hash (FNV-1a) built up one character at a time */
+#define NAMEHASH_INIT           0x811c9dc5u
+#define NameHashStep(h, ch)     (((h) ^ (uint8_t)tolower(ch)) * 0x01000193u)
+
+/* the same hash without case folding for string constants */
+#define StringHashStep(h, ch)   (((h) ^ (uint8_t)(ch)) * 0x01000193u)
 
 /* forward type declarations */
 typedef struct SymbolTable SymbolTable;
 typedef struct Symbol Symbol;
+typedef uint32_t SymbolHash;
 typedef struct ParseTreeNode ParseTreeNode;
-typedef struct NodeListEntry NodeListEntry;
 typedef struct ParseFile ParseFile;
 typedef struct IncludedFile IncludedFile;
 
+#ifdef COMPILE_CACHE
+typedef uint64_t CacheHash;
+#endif
+
 /* parse file */
 struct ParseFile {
     ParseFile *next;
     IncludedFile *file;
-    void *fp;
+    void *fp;                       /* file read a line at a time (if it couldn't be mapped) */
+    char *text;                     /* mapped source text scanned in place */
+    size_t size;                    /* size of the mapped source text */
+    char *nextLine;                 /* start of the next line in the mapped text */
+    char *lineEnd;                  /* terminator written after the current line */
+    char savedChar;                 /* character replaced by the terminator */
     int lineNumber;
 };
 
@@ -64,7 +93,6 @@ enum {
     T_AND,
     T_OR,
     T_NOT,
-    T_STOP,
     T_RETURN,
     T_PRINT,
     T_ASM,
@@ -105,13 +133,27 @@ typedef struct Block Block;
 struct Block {
     BlockType type;
     ParseTreeNode *node;
-    NodeListEntry **pNextStatement;
+    int firstStatement;             /* index in the list stack of the first statement of the block */
+    ParseTreeNode ***pStatements;   /* place to store the statement list when it is complete */
+};
+
+/* chunk of the stack of nodes of the lists being parsed */
+/* (chunks after the first are in low memory so they last until the program is compiled) */
+typedef struct NodeChunk NodeChunk;
+struct NodeChunk {
+    NodeChunk *next;                /* next chunk or NULL if it hasn't been needed yet */
+    ParseTreeNode *nodes[NODECHUNKSIZE];
 };
 
 /* string structure */
 typedef struct String String;
 struct String {
     String *next;
+    String *hashNext;               /* next string in the same hash chain */
+    uint32_t hash;                  /* hash of the string data */
+    size_t length;                  /* length of the string data (not counting the terminator) */
+    int placed;                     /* string has been placed in the image */
+    VMVALUE value;                  /* image offset or fixup chain if not placed */
     char data[1];
 };
 
@@ -172,42 +214,154 @@ struct Field {
 struct SymbolTable {
     Symbol *head;
     Symbol **pTail;
+    Symbol **buckets;       /* hash chains of symbols with the same case-folded name hash */
+    SymbolHash bucketMask;
     int count;
 };
 
 /* symbol structure */
 struct Symbol {
     Symbol *next;
+    Symbol *hashNext;
+    SymbolHash hash;
     StorageClass storageClass;
     Type *type;
     int placed;
     VMVALUE value;
+    VMVALUE definition;     /* code offset of a function in a relocatable module (zero if undefined) */
     char name[1];
 };
 
+/* global data block */
+typedef struct DataBlock DataBlock;
+struct DataBlock {
+    DataBlock *next;
+    Symbol *symbol;                 /* symbol for the data */
+    VMVALUE size;                   /* size in words */
+    VMVALUE *initializers;          /* initial values or NULL for bss */
+};
+
+/* constant pool entry */
+typedef struct {
+    Symbol *symbol;                 /* unplaced symbol or NULL */
+    String *string;                 /* unplaced string or NULL */
+    VMVALUE value;                  /* constant value if both are NULL */
+    int hashNext;                   /* next entry in the same hash chain (-1 at the end) */
+} Constant;
+
+/* line table entry */
+typedef struct LineEntry LineEntry;
+struct LineEntry {
+    LineEntry *next;
+    VMUVALUE offset;                /* offset of the code for the line */
+    int lineNumber;                 /* source line number */
+};
+
+/* reference from a function fragment to a global symbol or string */
+typedef struct FragmentRef FragmentRef;
+struct FragmentRef {
+    FragmentRef *next;
+    Symbol *symbol;                 /* referenced symbol or NULL */
+    String *string;                 /* referenced string or NULL */
+    VMUVALUE chain;                 /* fixup chain of references within the fragment */
+};
+
+/* relocatable copy of a single function */
+typedef struct {
+    VMUVALUE start;                 /* code offset of the fragment */
+    FragmentRef *refs;              /* symbols and strings referenced by the fragment */
+    LineEntry *lines;               /* line table entries for the fragment */
+    int lineCount;                  /* number of line table entries */
+} Fragment;
+
+/* code generator context */
+struct GenerateContext {
+    System *sys;                    /* system context */
+    HeapMark imageMark;             /* heap before the image buffer was allocated */
+    uint8_t *codeBuf;               /* base of the image buffer */
+    uint8_t *codeFree;              /* next free location in the image buffer */
+    uint8_t *codeTop;               /* top of the image buffer */
+    Constant constants[MAXCONSTANTS]; /* constant pool */
+    int constantCount;              /* number of constant pool entries in use */
+    int constantBuckets[CONSTANTBUCKETS]; /* first entry in each constant hash chain (-1 if empty) */
+    LineEntry *lines;               /* line table */
+    LineEntry **pNextLine;          /* place to link the next line table entry */
+    LineEntry *lastLine;            /* last line table entry added */
+    int lineCount;                  /* number of line table entries */
+    int relocatable;                /* generating a relocatable object module */
+    Fragment *fragment;             /* function fragment being captured or NULL */
+    int runtime;                    /* generating code for a running program */
+    VMVALUE mainCode;               /* start of the main code (zero until it is started) */
+    VMVALUE mainChunk;              /* start of the main code since it was last resumed (zero while suspended) */
+    VMUVALUE mainChain;             /* branch to where the main code resumes */
+    VMUVALUE linkStart;             /* start of the code of the object module being linked */
+    VMUVALUE linkEnd;               /* end of the code of the object module being linked */
+};
+
+/* function whose body is compiled when it is first called */
+typedef struct LazyFunction LazyFunction;
+struct LazyFunction {
+    LazyFunction *next;
+    Symbol *symbol;                 /* function symbol */
+    IncludedFile *file;             /* file containing the definition or NULL for the main source */
+    int lineNumber;                 /* line number of the FUNCTION statement */
+    int index;                      /* index passed to the compiler by the stub */
+    VMUVALUE stub;                  /* code offset of the stub */
+};
+
+#ifdef COMPILE_CACHE
+/* range of main source lines containing a function definition */
+typedef struct FunctionRange FunctionRange;
+struct FunctionRange {
+    FunctionRange *next;
+    int startLine;                  /* line number of the FUNCTION statement */
+    int endLine;                    /* line number of the END FUNCTION statement */
+    CacheHash hash;                 /* hash of the source lines of the function */
+};
+#endif
+
 /* parse context */
 typedef struct {
     System *sys;                    /* system context */
     GenerateContext *g;             /* generate - generate context */
     ParseFile *currentFile;         /* current input file */
     IncludedFile *includedFiles;    /* list of files that have already been included */
+    const char *mainFile;           /* file containing the main program (NULL to use the main source) */
     int lineNumber;                 /* scan - current line number */
     int savedToken;                 /* scan - lookahead token */
     int tokenOffset;                /* scan - offset to the start of the current token */
     char token[MAXTOKEN];           /* scan - current token string */
     VMVALUE tokenValue;             /* scan - current token integer value */
+    SymbolHash tokenHash;           /* scan - case-folded hash of an identifier token */
     int inComment;                  /* scan - inside of a slash/star comment */
     SymbolTable globals;            /* parse - global variables and constants */
     String *strings;                /* parse - string constants */
+    String **stringBuckets;         /* parse - hash chains of the string constants */
+    DataBlock *dataBlocks;          /* parse - global data blocks */
+    DataBlock **pNextDataBlock;     /* parse - place to link the next data block */
     ParseTreeNode *mainFunction;    /* parse - the main function */
     ParseTreeNode *currentFunction; /* parse - the function currently being parsed */
     Block blockBuf[10];             /* parse - stack of nested blocks */
     Block *bptr;                    /* parse - current block */
     Block *btop;                    /* parse - top of block stack */
+    NodeChunk nodeStack;            /* parse - first chunk of the stack of nodes of the lists being parsed */
+    NodeChunk *nodeChunk;           /* parse - chunk of the list stack used last */
+    int nodeChunkBase;              /* parse - index in the list stack of the first node in nodeChunk */
+    int nodeCount;                  /* parse - number of nodes on the list stack */
+    HeapMark treeMark;              /* parse - heap to return to when a parse tree is released */
     Type unknownType;               /* parse - unknown type */
     Type integerType;               /* parse - integer type */
     Type stringType;                /* parse - string type */
     Type integerFunctionType;       /* parse - integer function type */
+    int lazy;                       /* lazy - compile function bodies when they are first called */
+    LazyFunction *lazyFunctions;    /* lazy - functions with stubs */
+    int lazyFunctionCount;          /* lazy - number of functions with stubs */
+    LazyFunction *compilingFunction; /* lazy - function being compiled for a running program */
+#ifdef COMPILE_CACHE
+    FunctionRange *functionRanges;  /* cache - function definitions in the main source */
+    CacheHash fragmentKey;          /* cache - key of the function being parsed */
+    int cacheFragment;              /* cache - save the function being parsed as a fragment */
+#endif
 } ParseContext;
 
 /* parse tree node types */
@@ -240,9 +394,11 @@ typedef enum {
 } NodeType;
 
 /* parse tree node structure */
+/* (statement, argument and expression lists are NULL terminated arrays or NULL if empty) */
 struct ParseTreeNode {
     NodeType nodeType;
     Type *type;
+    int lineNumber;
     union {
         struct {
             Symbol *symbol;
@@ -250,7 +406,7 @@ struct ParseTreeNode {
             SymbolTable locals;
             int argumentOffset;
             int localOffset;
-            NodeListEntry *bodyStatements;
+            ParseTreeNode **bodyStatements;
         } functionDefinition;
         struct {
             ParseTreeNode *lvalue;
@@ -258,19 +414,19 @@ struct ParseTreeNode {
         } letStatement;
         struct {
             ParseTreeNode *test;
-            NodeListEntry *thenStatements;
-            NodeListEntry *elseStatements;
+            ParseTreeNode **thenStatements;
+            ParseTreeNode **elseStatements;
         } ifStatement;
         struct {
             ParseTreeNode *var;
             ParseTreeNode *startExpr;
             ParseTreeNode *endExpr;
             ParseTreeNode *stepExpr;
-            NodeListEntry *bodyStatements;
+            ParseTreeNode **bodyStatements;
         } forStatement;
         struct {
             ParseTreeNode *test;
-            NodeListEntry *bodyStatements;
+            ParseTreeNode **bodyStatements;
         } loopStatement;
         struct {
             ParseTreeNode *expr;
@@ -306,34 +462,64 @@ struct ParseTreeNode {
         } arrayRef;
         struct {
             ParseTreeNode *fcn;
-            NodeListEntry *args;
+            ParseTreeNode **args;
             int argc;
         } functionCall;
         struct {
-            NodeListEntry *exprs;
+            ParseTreeNode **exprs;
         } exprList;
     } u;
 };
 
-/* node list entry structure */
-struct NodeListEntry {
-    ParseTreeNode *node;
-    NodeListEntry *next;
-};
-
 /* compile.c */
 ParseContext *InitCompileContext(System *sys);
-void Compile(ParseContext *c);
+uint8_t *Compile(ParseContext *c);
+int CompileObject(ParseContext *c, const char *name);
+ObjectHdr *CompileObjectModule(ParseContext *c);
+
+/* cache.c */
+#ifdef COMPILE_CACHE
+CacheHash HashInit(void);
+CacheHash HashBytes(CacheHash hash, const void *data, size_t size);
+uint8_t *FindCachedImage(System *sys, CacheHash key);
+void CacheImage(ParseContext *c, CacheHash key, uint8_t *image);
+int LinkCachedFunction(ParseContext *c);
+void CacheFunction(ParseContext *c);
+#endif
+
+/* link.c */
+int IsObjectName(const char *name);
+int ExportKind(Symbol *symbol);
+ObjectHdr *BuildObject(ParseContext *c);
+void WriteObject(ParseContext *c, ObjectHdr *hdr, const char *name);
+int WriteFragment(ParseContext *c, const char *name, Symbol *symbol, Fragment *f);
+void LinkObject(ParseContext *c, const char *name);
+void LinkObjectModule(ParseContext *c, const char *name, uint8_t *object);
+
+/* lazy.c */
+void AddLazyFunction(ParseContext *c, Symbol *symbol);
+LazyFunction *FindLazyFunction(ParseContext *c, VMVALUE index);
+VMVALUE CompileLazyFunction(ParseContext *c, LazyFunction *f);
 
 /* parse.c */
 ParseContext *InitParseContext(System *sys);
+IncludedFile *AddIncludedFile(ParseContext *c, const char *name);
 int PushFile(ParseContext *c, const char *name);
+ParseFile *OpenParseFile(ParseContext *c, IncludedFile *inc);
+int ReadParseFile(System *sys, ParseFile *f);
+void CloseParseFile(ParseFile *f);
 int ParseGetLine(ParseContext *c);
 ParseTreeNode *StartFunction(ParseContext *c, Symbol *symbol);
 void ParseStatement(ParseContext *c, int tkn);
+void FlushMain(ParseContext *c);
+void ResolveImplicitGlobals(ParseContext *c);
 VMVALUE ParseIntegerConstant(ParseContext *c);
 ParseTreeNode *NewParseTreeNode(ParseContext *c, int type);
-void AddNodeToList(ParseContext *c, NodeListEntry ***ppNextEntry, ParseTreeNode *node);
+void AddNodeToList(ParseContext *c, ParseTreeNode *node);
+ParseTreeNode **EndNodeList(ParseContext *c, int first);
+void EndStatementList(ParseContext *c);
+String *AddString(ParseContext *c, const char *value);
+DataBlock *AddDataBlock(ParseContext *c, Symbol *symbol, VMVALUE size, int initialized);
 void PrintNode(ParseTreeNode *node, int indent);
 void DumpStrings(ParseContext *c);
 
@@ -351,26 +537,48 @@ int SkipSpaces(ParseContext *c);
 int GetChar(ParseContext *c);
 void UngetC(ParseContext *c);
 void ParseError(ParseContext *c, const char *fmt, ...);
+int CrunchedToken(int ch);
+int CrunchLine(const char *src, char *buf, int size, int *pInComment);
+int ExpandLine(const char *src, char *buf, int size, int *pInComment);
 
 /* symbols.c */
-void InitSymbolTable(SymbolTable *table);
+void InitSymbolTable(ParseContext *c, SymbolTable *table, int bucketCount);
+SymbolHash HashName(const char *name);
 Symbol *AddGlobal(ParseContext *c, const char *name, StorageClass storageClass, Type *type, VMVALUE value);
 Symbol *AddArgument(ParseContext *c, const char *name, StorageClass storageClass, Type *type, VMVALUE value);
 Symbol *AddLocal(ParseContext *c, const char *name, StorageClass storageClass, Type *type, VMVALUE value);
-Symbol *FindGlobal(ParseContext *c, const char *name);
-Symbol *FindArgument(ParseContext *c, const char *name);
-Symbol *FindLocal(ParseContext *c, const char *name);
+Symbol *FindGlobal(ParseContext *c, const char *name, SymbolHash hash);
+Symbol *FindArgument(ParseContext *c, const char *name, SymbolHash hash);
+Symbol *FindLocal(ParseContext *c, const char *name, SymbolHash hash);
 int IsConstant(Symbol *symbol);
 void DumpSymbols(SymbolTable *table, const char *tag);
 
 /* generate.c */
 GenerateContext *InitGenerateContext(System *sys);
 VMVALUE Generate(GenerateContext *c, ParseTreeNode *node);
+void GenerateMain(GenerateContext *c, ParseTreeNode *node);
+void SuspendMain(GenerateContext *c);
+VMVALUE EndMain(GenerateContext *c, ParseTreeNode *node);
+void GenerateFragment(GenerateContext *c, ParseTreeNode *node, Fragment *f);
+void DiscardFragment(GenerateContext *c, Fragment *f);
 void PlaceSymbol(GenerateContext *c, Symbol *sym, VMUVALUE offset);
+void PlaceString(GenerateContext *c, String *str, VMUVALUE offset);
+void DefineFunction(GenerateContext *c, Symbol *sym, VMUVALUE offset);
+VMVALUE GenerateStub(GenerateContext *c, Symbol *sym, int index);
+void PatchStub(GenerateContext *c, VMUVALUE stub, VMUVALUE code);
+VMVALUE StoreCode(GenerateContext *c, const uint8_t *code, int size);
+void LinkSymbolRefs(GenerateContext *c, Symbol *sym, VMUVALUE chain, VMVALUE delta);
+void LinkStringRefs(GenerateContext *c, String *str, VMUVALUE chain, VMVALUE delta);
 VMVALUE StoreVector(GenerateContext *c, const VMVALUE *buf, int size);
 VMVALUE StoreByteVector(GenerateContext *c, const uint8_t *buf, int size);
+void LinkLines(GenerateContext *c, const ImageLine *lines, int count, VMVALUE delta);
+VMVALUE StoreLines(GenerateContext *c);
+VMVALUE ReserveSpace(GenerateContext *c, int size);
+void StoreConstants(GenerateContext *c, VMUVALUE offset);
 void DumpFunctions(GenerateContext *c);
+void DumpConstants(GenerateContext *c);
 VMVALUE codeaddr(GenerateContext *c);
+VMVALUE alignaddr(GenerateContext *c);
 VMVALUE putcbyte(GenerateContext *c, int b);
 VMVALUE putcword(GenerateContext *c, VMVALUE w);
 VMVALUE putdword(GenerateContext *c, VMVALUE w);
@@ -27,7 +27,7 @@ static char *typeNames[] = {
 };
 
 /* local function prototypes */
-static void PrintNodeList(NodeListEntry *entry, int indent);
+static void PrintNodeList(ParseTreeNode **list, int indent);
 static char *StorageClassName(StorageClass storageClass);
 static char *TypeName(TypeID typeID);
 
@@ -178,11 +178,11 @@ void PrintNode(ParseTreeNode *node, int indent)
     }
 }
 
-static void PrintNodeList(NodeListEntry *entry, int indent)
+static void PrintNodeList(ParseTreeNode **list, int indent)
 {
-    while (entry != NULL) {
-        PrintNode(entry->node, indent);
-        entry = entry->next;
+    if (list) {
+        while (*list != NULL)
+            PrintNode(*list++, indent);
     }
 }
 
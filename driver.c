@@ -0,0 +1,186 @@
+/* driver.c - compile and run source files named on the command line
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ * The main program is read from its file like an include file rather than
+ * through the edit buffer so it has no line length limit. A #! line at the
+ * start of the file lets it be run as a script. A program can also be read from
+ * another line source, like the connection to a client of the server.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "driver.h"
+#include "compile.h"
+#include "image.h"
+#include "vmint.h"
+
+/* local function prototypes */
+static int RunProgram(System *sys, const char *name, GetLineHandler *source, void *sourceCookie);
+static ParseContext *InitFileContext(System *sys, const char *name);
+static int IsImageName(const char *name);
+static char *NoMainSource(char *buf, int len, int *pLineNumber, void *cookie);
+
+/* RunFile - compile a source file and run it (an image file is run without compiling anything) */
+int RunFile(System *sys, const char *name)
+{
+    return IsImageName(name) ? ExecFile(sys, name) : RunProgram(sys, name, NoMainSource, NULL);
+}
+
+/* RunSource - compile a program read from a line source and run it */
+int RunSource(System *sys, GetLineHandler *source, void *sourceCookie)
+{
+    return RunProgram(sys, NULL, source, sourceCookie);
+}
+
+/* ExecFile - run an image file */
+int ExecFile(System *sys, const char *name)
+{
+    uint8_t *image;
+    int sts = VMFALSE;
+
+    StartTiming(sys);
+    if (!(image = MapImage(sys, name)))
+        VM_printf("error loading '%s'\n", name);
+    else {
+        sts = RunImage(sys, image, 1024);
+        UnmapImage(image);
+    }
+    VM_flush();
+
+    return sts;
+}
+
+/* RunProgram - compile a program from a file or, if there is no file name, a line source and run it */
+static int RunProgram(System *sys, const char *name, GetLineHandler *source, void *sourceCookie)
+{
+    GetLineHandler *getLine;
+    void *getLineCookie;
+    ParseContext *c;
+    uint8_t *image;
+    HeapMark mark;
+    int sts = VMFALSE;
+
+    MarkHeap(sys, &mark);
+    GetMainSource(sys, &getLine, &getLineCookie);
+
+    if ((c = InitFileContext(sys, name)) != NULL) {
+        SetMainSource(sys, source, sourceCookie);
+        if ((image = Compile(c)) != NULL)
+            sts = RunImage(sys, image, 1024);
+    }
+
+    SetMainSource(sys, getLine, getLineCookie);
+    ReleaseHighMemory(sys, &mark);
+    ReleaseLowMemory(sys, &mark);
+    VM_flush();
+
+    return sts;
+}
+
+/* BuildFile - compile a source file to an image or, if the output name ends in .obj, an object module */
+/* (the image is written next to the source file if no output name is given) */
+int BuildFile(System *sys, const char *name, const char *outputName)
+{
+    char defaultName[FILENAME_MAX];
+    GetLineHandler *getLine;
+    void *getLineCookie;
+    ParseContext *c;
+    uint8_t *image;
+    HeapMark mark;
+    int sts = VMFALSE;
+    char *p;
+
+    /* replace the extension of the source file with .img */
+    if (!outputName) {
+        strncpy(defaultName, name, FILENAME_MAX - 1);
+        defaultName[FILENAME_MAX - 1] = '\0';
+        if ((p = strrchr(defaultName, '.')) != NULL && !strchr(p, '/'))
+            *p = '\0';
+        if (strlen(defaultName) >= FILENAME_MAX - 5) {
+            VM_printf("error: file name too long: %s\n", name);
+            return VMFALSE;
+        }
+        strcat(defaultName, ".img");
+        outputName = defaultName;
+    }
+
+    MarkHeap(sys, &mark);
+    GetMainSource(sys, &getLine, &getLineCookie);
+
+    if ((c = InitFileContext(sys, name)) != NULL) {
+
+        /* compile an object module */
+        if (IsObjectName(outputName))
+            sts = CompileObject(c, outputName);
+
+        /* compile the program and write its image */
+        else if ((image = Compile(c)) != NULL) {
+            if (!(sts = SaveImage(outputName, image)))
+                VM_printf("error writing '%s'\n", outputName);
+        }
+    }
+
+    SetMainSource(sys, getLine, getLineCookie);
+    ReleaseHighMemory(sys, &mark);
+    ReleaseLowMemory(sys, &mark);
+    VM_flush();
+
+    return sts;
+}
+
+/* BuildModule - compile a file of declarations and functions to an object module that outlives the heap */
+/* (the object module is allocated with malloc and NULL is returned if the file doesn't compile on its own */
+/* or includes other files, since those wouldn't count as included when the module is linked) */
+uint8_t *BuildModule(System *sys, const char *name)
+{
+    GetLineHandler *getLine;
+    void *getLineCookie;
+    uint8_t *object = NULL;
+    ParseContext *c;
+    ObjectHdr *hdr;
+    HeapMark mark;
+
+    MarkHeap(sys, &mark);
+    GetMainSource(sys, &getLine, &getLineCookie);
+
+    if ((c = InitFileContext(sys, name)) != NULL && (hdr = CompileObjectModule(c)) != NULL) {
+        if (c->includedFiles->next)
+            VM_printf("error: '%s' includes other files\n", name);
+        else if ((object = (uint8_t *)malloc(hdr->objectSize)) != NULL)
+            memcpy(object, hdr, hdr->objectSize);
+    }
+
+    SetMainSource(sys, getLine, getLineCookie);
+    ReleaseHighMemory(sys, &mark);
+    ReleaseLowMemory(sys, &mark);
+    VM_flush();
+
+    return object;
+}
+
+/* InitFileContext - initialize a compile context to read the main program from a file (or the main source if NULL) */
+static ParseContext *InitFileContext(System *sys, const char *name)
+{
+    ParseContext *c;
+    StartTiming(sys);
+    if (!(c = InitCompileContext(sys)))
+        return NULL;
+    c->mainFile = name;
+    SetMainSource(sys, NoMainSource, NULL);
+    return c;
+}
+
+/* IsImageName - check for the name of an image file */
+static int IsImageName(const char *name)
+{
+    size_t len = strlen(name);
+    return len >= 4 && strcasecmp(&name[len - 4], ".img") == 0;
+}
+
+/* NoMainSource - the main source is empty when the main program is in a file */
+static char *NoMainSource(char *buf, int len, int *pLineNumber, void *cookie)
+{
+    return NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef __DRIVER_H__
+#define __DRIVER_H__
+
+#include "system.h"
+
+/* driver.c */
+int RunFile(System *sys, const char *name);
+int RunSource(System *sys, GetLineHandler *source, void *sourceCookie);
+int ExecFile(System *sys, const char *name);
+int BuildFile(System *sys, const char *name, const char *outputName);
+uint8_t *BuildModule(System *sys, const char *name);
+
+#endif
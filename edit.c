@@ -5,6 +5,11 @@
  * This code maintains an edit buffer at the top of memory and hence adjusts the
  * size of the buffer by moving the start of the buffer rather than the top.
  *
+ * The lines are stored in order going down from the top of the buffer and below
+ * them is an index with the offset of each line from the top. Lines are found by
+ * a binary search of the index and adding a line only moves the index and the
+ * lines that follow it.
+ *
  */
 
 #include <stdio.h>
@@ -13,6 +18,7 @@
 #include <ctype.h>
 #include "edit.h"
 #include "compile.h"
+#include "vmint.h"
 
 #define MAXTOKEN        32
 
@@ -27,9 +33,12 @@ typedef struct {
 #ifdef LOAD_SAVE
     char programName[FILENAME_MAX];
 #endif
-    uint8_t *buffer;
+    uint8_t *buffer;                /* base of the line index */
     uint8_t *bufferTop;
-    Line *currentLine;
+    int lineCount;
+    int currentLine;
+    HeapMark heapMark;
+    ParseContext *context;
 } EditBuf;
 
 /* command handlers */
@@ -41,6 +50,8 @@ static void DoRenum(EditBuf *buf);
 static void DoLoad(EditBuf *buf);
 static void DoSave(EditBuf *buf);
 static void DoCat(EditBuf *buf);
+static void DoCompile(EditBuf *buf);
+static void DoExec(EditBuf *buf);
 #endif
 
 /* command table */
@@ -56,6 +67,8 @@ static struct {
 {   "LOAD",     DoLoad  },
 {   "SAVE",     DoSave  },
 {   "CAT",      DoCat   },
+{   "COMPILE",  DoCompile },
+{   "EXEC",     DoExec  },
 #endif
 {   NULL,       NULL    }
 };
@@ -66,6 +79,15 @@ static int ParseNumber(char *token, int *pValue);
 static int IsBlank(char *p);
 #ifdef LOAD_SAVE
 static int SetProgramName(EditBuf *buf);
+static int GetImageName(EditBuf *buf, char *name);
+#endif
+static uint8_t *CompileBuffer(EditBuf *buf, const char *objectName, int cache, int lazy);
+static void RunLazy(EditBuf *buf);
+static VMVALUE CompileCalledFunction(void *cookie, VMVALUE index);
+#ifdef COMPILE_CACHE
+static CacheHash HashBuffer(EditBuf *buf);
+static FunctionRange *FindFunctionRanges(EditBuf *buf);
+static int StartsWithKeywords(const char *p, int token1, int token2);
 #endif
 
 /* edit buffer prototypes */
@@ -73,9 +95,19 @@ static EditBuf *BufInit(System *sys);
 static void BufNew(EditBuf *buf);
 static int BufAddLineN(EditBuf *buf, int lineNumber, const char *text);
 static int BufDeleteLineN(EditBuf *buf, int lineNumber);
+static int BufStoreLine(EditBuf *buf, int i, int replace, int lineNumber, const char *crunched);
+static int BufRecrunch(EditBuf *buf, int i, int oldInComment, int newInComment);
+static int BufCommentState(EditBuf *buf, int i);
+static int LineCommentState(const char *text, int inComment);
+#ifdef LOAD_SAVE
+static int BufAppendLine(EditBuf *buf, int lineNumber, const char *text, int *pInComment);
+static int BufBuildIndex(EditBuf *buf);
+#endif
+static void BufReserve(EditBuf *buf);
 static int BufSeekN(EditBuf *buf, int lineNumber);
 static char *BufGetLine(EditBuf *buf, int *pLineNumber, char *text);
-static int FindLineN(EditBuf *buf, int lineNumber, Line **pLine);
+static int FindLineN(EditBuf *buf, int lineNumber, int *pIndex);
+static Line *LineAt(EditBuf *buf, int i);
 
 void EditWorkspace(System *sys)
 {
@@ -129,10 +161,13 @@ static void DoNew(EditBuf *buf)
 
 static void DoList(EditBuf *buf)
 {
-    int lineNumber;
+    char text[MAXLINE];
+    int lineNumber, inComment = VMFALSE;
     BufSeekN(buf, 0);
-    while (BufGetLine(buf, &lineNumber, buf->sys->lineBuf))
-        VM_printf("%d %s", lineNumber, buf->sys->lineBuf);
+    while (BufGetLine(buf, &lineNumber, buf->sys->lineBuf)) {
+        ExpandLine(buf->sys->lineBuf, text, sizeof(text), &inComment);
+        VM_printf("%d %s", lineNumber, text);
+    }
 }
 
 static char *EditGetLine(char *buf, int len, int *pLineNumber, void *cookie)
@@ -142,38 +177,187 @@ static char *EditGetLine(char *buf, int len, int *pLineNumber, void *cookie)
 }
 
 static void DoRun(EditBuf *buf)
+{
+    System *sys = buf->sys;
+    uint8_t *image;
+    char *token;
+    
+    /* RUN LAZY compiles each function the first time it is called */
+    if ((token = NextToken(sys)) != NULL && strcasecmp(token, "LAZY") == 0) {
+        RunLazy(buf);
+        return;
+    }
+    
+#ifdef COMPILE_CACHE
+    /* run the cached image if the program and its include files haven't changed */
+    /* (in whatever memory is not used by the edit buffer like an image that was compiled) */
+    BufReserve(buf);
+    StartTiming(sys);
+    if ((image = FindCachedImage(sys, HashBuffer(buf))) != NULL) {
+        RunImage(sys, image, 1024);
+        UnmapImage(image);
+        return;
+    }
+#endif
+
+    if ((image = CompileBuffer(buf, NULL, VMTRUE, VMFALSE)) != NULL)
+        RunImage(sys, image, 1024);
+}
+
+/* run the program compiling each function the first time it is called */
+static void RunLazy(EditBuf *buf)
+{
+    System *sys = buf->sys;
+    GetLineHandler *getLine;
+    void *getLineCookie;
+    uint8_t *image;
+    
+    if ((image = CompileBuffer(buf, NULL, VMFALSE, VMTRUE)) != NULL) {
+        GetMainSource(sys, &getLine, &getLineCookie);
+        sys->compileFunction = CompileCalledFunction;
+        sys->compileFunctionCookie = buf;
+        RunImage(sys, image, 1024);
+        sys->compileFunction = NULL;
+        sys->compileFunctionCookie = NULL;
+        SetMainSource(sys, getLine, getLineCookie);
+    }
+}
+
+/* compile a function of a program run with RUN LAZY when it is first called */
+static VMVALUE CompileCalledFunction(void *cookie, VMVALUE index)
+{
+    EditBuf *buf = (EditBuf *)cookie;
+    ParseContext *c = buf->context;
+    LazyFunction *f;
+    
+    if (!(f = FindLazyFunction(c, index)))
+        return 0;
+        
+    /* functions in the main source are read from the edit buffer */
+    SetMainSource(buf->sys, EditGetLine, buf);
+    if (!f->file && !BufSeekN(buf, f->lineNumber))
+        return 0;
+        
+    return CompileLazyFunction(c, f);
+}
+
+#ifdef COMPILE_CACHE
+/* hash the edit buffer to get its compile cache key */
+static CacheHash HashBuffer(EditBuf *buf)
+{
+    CacheHash hash = HashInit();
+    int lineNumber;
+    BufSeekN(buf, 0);
+    while (BufGetLine(buf, &lineNumber, buf->sys->lineBuf)) {
+        hash = HashBytes(hash, &lineNumber, sizeof(lineNumber));
+        hash = HashBytes(hash, buf->sys->lineBuf, strlen(buf->sys->lineBuf));
+    }
+    return hash;
+}
+
+/* find the function definitions in the edit buffer so unchanged ones can come from the cache */
+static FunctionRange *FindFunctionRanges(EditBuf *buf)
+{
+    System *sys = buf->sys;
+    FunctionRange *ranges = NULL, *range;
+    int lineNumber, startLine = 0;
+    CacheHash hash = 0;
+    
+    BufSeekN(buf, 0);
+    while (BufGetLine(buf, &lineNumber, sys->lineBuf)) {
+        if (StartsWithKeywords(sys->lineBuf, T_FUNCTION, T_NONE)) {
+            startLine = lineNumber;
+            hash = HashInit();
+        }
+        if (startLine) {
+            hash = HashBytes(hash, &lineNumber, sizeof(lineNumber));
+            hash = HashBytes(hash, sys->lineBuf, strlen(sys->lineBuf));
+            if (StartsWithKeywords(sys->lineBuf, T_END, T_FUNCTION)) {
+                if (!(range = (FunctionRange *)AllocateHighMemory(sys, sizeof(FunctionRange), HEAP_COMPILER)))
+                    break;
+                range->startLine = startLine;
+                range->endLine = lineNumber;
+                range->hash = hash;
+                range->next = ranges;
+                ranges = range;
+                startLine = 0;
+            }
+        }
+    }
+    
+    return ranges;
+}
+
+/* check whether a crunched line starts with a keyword or a pair of keywords */
+static int StartsWithKeywords(const char *p, int token1, int token2)
+{
+    int tokens[2], i;
+    tokens[0] = token1;
+    tokens[1] = token2;
+    for (i = 0; i < 2 && tokens[i] != T_NONE; ++i) {
+        while (*p != '\0' && isspace((uint8_t)*p))
+            ++p;
+        if (CrunchedToken((uint8_t)*p++) != tokens[i])
+            return VMFALSE;
+    }
+    return VMTRUE;
+}
+#endif
+
+/* compile the edit buffer to an image or, if objectName is not NULL, to an object module */
+static uint8_t *CompileBuffer(EditBuf *buf, const char *objectName, int cache, int lazy)
 {
     System *sys = buf->sys;
     ParseContext *c;
     GetLineHandler *getLine;
     void *getLineCookie;
+    uint8_t *image = NULL;
     
-    sys->nextHigh = buf->buffer;
-    sys->nextLow = sys->freeSpace;
+    BufReserve(buf);
+    StartTiming(sys);
     
-    if (!(c = InitCompileContext(sys)))
+    if (!(c = InitCompileContext(sys))) {
         VM_printf("insufficient memory");
+        return NULL;
+    }
+    buf->context = c;
+    c->lazy = lazy;
     
+#ifdef COMPILE_CACHE
+    /* unchanged function definitions can be linked from the compile cache */
+    if (cache)
+        c->functionRanges = FindFunctionRanges(buf);
+#endif
+
     GetMainSource(sys, &getLine, &getLineCookie);
     
     SetMainSource(sys, EditGetLine, buf);
     BufSeekN(buf, 0);
 
-    Compile(c);
+    if (objectName)
+        CompileObject(c, objectName);
+    else
+        image = Compile(c);
+        
+#ifdef COMPILE_CACHE
+    /* add the image to the compile cache */
+    if (image && cache)
+        CacheImage(c, HashBuffer(buf), image);
+#endif
 
     SetMainSource(sys, getLine, getLineCookie);
+    
+    return image;
 }
 
 static void DoRenum(EditBuf *buf)
 {
-    uint8_t *p = buf->buffer;
     int lineNumber = 100;
     int increment = 10;
-    while (p < buf->bufferTop) {
-        Line *line = (Line *)p;
-        line->lineNumber = lineNumber;
+    int i;
+    for (i = 0; i < buf->lineCount; ++i) {
+        LineAt(buf, i)->lineNumber = lineNumber;
         lineNumber += increment;
-        p = p + line->length;
     }
 }
 
@@ -197,6 +381,7 @@ static void DoLoad(EditBuf *buf)
 {
     int lineNumber = 100;
     int lineNumberIncrement = 10;
+    int inComment = VMFALSE;
     VMFILE *fp;
     
     /* check for a program name on the command line */
@@ -213,10 +398,17 @@ static void DoLoad(EditBuf *buf)
         VM_printf("Loading '%s'\n", buf->programName);
         BufNew(buf);
         while (VM_fgets(sys->lineBuf, sizeof(sys->lineBuf), fp) != NULL) {
-            BufAddLineN(buf, lineNumber, sys->lineBuf);
+            if (!BufAppendLine(buf, lineNumber, sys->lineBuf, &inComment)) {
+                VM_printf("out of edit buffer space\n");
+                break;
+            }
             lineNumber += lineNumberIncrement;
         }
         VM_fclose(fp);
+        if (!BufBuildIndex(buf)) {
+            VM_printf("out of edit buffer space\n");
+            BufNew(buf);
+        }
     }
 }
 
@@ -235,15 +427,94 @@ static void DoSave(EditBuf *buf)
         VM_printf("error saving '%s'\n", buf->programName);
     else {
         System *sys = buf->sys;
-        int lineNumber;
+        char text[MAXLINE];
+        int lineNumber, inComment = VMFALSE;
         VM_printf("Saving '%s'\n", buf->programName);
         BufSeekN(buf, 0);
-        while (BufGetLine(buf, &lineNumber, sys->lineBuf))
-            VM_fputs(sys->lineBuf, fp);
+        while (BufGetLine(buf, &lineNumber, sys->lineBuf)) {
+            ExpandLine(sys->lineBuf, text, sizeof(text), &inComment);
+            VM_fputs(text, fp);
+        }
         VM_fclose(fp);
     }
 }
 
+static int GetImageName(EditBuf *buf, char *name)
+{
+    char *token, *p;
+    
+    /* use the name on the command line or the program name */
+    if ((token = NextToken(buf->sys)) != NULL)
+        strncpy(name, token, FILENAME_MAX - 1);
+    else if (buf->programName[0] != '\0')
+        strncpy(name, buf->programName, FILENAME_MAX - 1);
+    else
+        return VMFALSE;
+    name[FILENAME_MAX - 1] = '\0';
+    
+    /* object module names are used as is */
+    if (IsObjectName(name))
+        return VMTRUE;
+    
+    /* replace the extension with .img */
+    if ((p = strrchr(name, '.')) != NULL)
+        *p = '\0';
+    if (strlen(name) < FILENAME_MAX - 5)
+        strcat(name, ".img");
+        
+    return VMTRUE;
+}
+
+static void DoCompile(EditBuf *buf)
+{
+    char name[FILENAME_MAX];
+    uint8_t *image;
+    
+    /* check for an image name on the command line */
+    if (!GetImageName(buf, name)) {
+        VM_printf("expecting a file name\n");
+        return;
+    }
+    
+    /* compile an object module */
+    if (IsObjectName(name)) {
+        VM_printf("Writing '%s'\n", name);
+        CompileBuffer(buf, name, VMFALSE, VMFALSE);
+    }
+    
+    /* compile the program and write its image */
+    else if ((image = CompileBuffer(buf, NULL, VMFALSE, VMFALSE)) != NULL) {
+        VM_printf("Writing '%s'\n", name);
+        if (!SaveImage(name, image))
+            VM_printf("error writing '%s'\n", name);
+    }
+}
+
+static void DoExec(EditBuf *buf)
+{
+    System *sys = buf->sys;
+    char name[FILENAME_MAX];
+    uint8_t *image;
+    
+    /* check for an image name on the command line */
+    if (!GetImageName(buf, name)) {
+        VM_printf("expecting a file name\n");
+        return;
+    }
+    
+    /* the image runs in whatever memory is not used by the edit buffer */
+    BufReserve(buf);
+    
+    /* map the image and run it without compiling anything */
+    StartTiming(sys);
+    if (!(image = MapImage(sys, name)))
+        VM_printf("error loading '%s'\n", name);
+    else {
+        RunImage(sys, image, 1024);
+        UnmapImage(image);
+    }
+}
+
 static void DoCat(EditBuf *buf)
 {
     VMDIRENT entry;
@@ -299,91 +570,249 @@ static int IsBlank(char *p)
 static EditBuf *BufInit(System *sys)
 {
     EditBuf *buf;
-    if (!(buf = (EditBuf *)AllocateHighMemory(sys, sizeof(EditBuf))))
+    if (!(buf = (EditBuf *)AllocateHighMemory(sys, sizeof(EditBuf), HEAP_EDIT_BUFFER)))
         return NULL;
     memset(buf, 0, sizeof(EditBuf));
     buf->sys = sys;
     buf->bufferTop = sys->nextHigh;
     buf->buffer = buf->bufferTop;
-    buf->currentLine = (Line *)buf->buffer;
+    MarkHeap(sys, &buf->heapMark);
     return buf;
 }
 
 static void BufNew(EditBuf *buf)
 {
     buf->buffer = buf->bufferTop;
-    buf->currentLine = (Line *)buf->buffer;
+    buf->lineCount = 0;
+    buf->currentLine = 0;
 }
 
 static int BufAddLineN(EditBuf *buf, int lineNumber, const char *text)
 {
-    int newLength = sizeof(Line) + strlen(text);
-    int spaceNeeded;
+    char crunched[MAXLINE];
+    int inComment, oldInComment;
+    int replace, i;
+
+    /* find where the line goes and whether it starts in a block comment */
+    replace = FindLineN(buf, lineNumber, &i);
+    inComment = BufCommentState(buf, i);
+    oldInComment = replace ? LineCommentState(LineAt(buf, i)->text, inComment) : inComment;
+
+    /* lines are stored with their keywords crunched to single bytes */
+    CrunchLine(text, crunched, sizeof(crunched), &inComment);
+    if (!BufStoreLine(buf, i, replace, lineNumber, crunched))
+        return VMFALSE;
+
+    /* the lines that follow must be crunched again if the line opens or closes a block comment */
+    return BufRecrunch(buf, i + 1, oldInComment, inComment);
+}
+
+static int BufDeleteLineN(EditBuf *buf, int lineNumber)
+{
+    int inComment, oldInComment;
+    int spaceFreed;
+    uint8_t *next;
+    int *index;
+    int i, j;
+
+    /* find the line to delete */
+    if (!FindLineN(buf, lineNumber, &i))
+        return VMFALSE;
+
+    /* find whether the line starts or ends in a block comment */
+    inComment = BufCommentState(buf, i);
+    oldInComment = LineCommentState(LineAt(buf, i)->text, inComment);
+
+    /* get a pointer to the top of the lines that follow it */
+    next = (uint8_t *)LineAt(buf, i);
+    spaceFreed = LineAt(buf, i)->length;
+
+    /* remove the index entry for the line */
+    memmove(buf->buffer + sizeof(int), buf->buffer, i * sizeof(int));
+    buf->buffer += sizeof(int);
+    --buf->lineCount;
+
+    /* remove the line to be deleted */
+    memmove(buf->buffer + spaceFreed, buf->buffer, next - buf->buffer);
+    buf->buffer += spaceFreed;
+
+    /* adjust the offsets of the lines that follow it */
+    index = (int *)buf->buffer;
+    for (j = i; j < buf->lineCount; ++j)
+        index[j] -= spaceFreed;
+
+    /* the lines that follow must be crunched again if the line opened or closed a block comment */
+    if (!BufRecrunch(buf, i, oldInComment, inComment))
+        VM_printf("out of edit buffer space\n");
+
+    /* return successfully */
+    return VMTRUE;
+}
+
+/* store a crunched line at an index replacing the line that is there or inserting a new one */
+static int BufStoreLine(EditBuf *buf, int i, int replace, int lineNumber, const char *crunched)
+{
+    int newLength, oldLength;
+    int spaceNeeded, indexNeeded;
     uint8_t *next;
     Line *line;
+    int *index;
+    int j;
 
     /* make sure the length is a multiple of the word size */
+    newLength = sizeof(Line) + strlen(crunched);
     newLength = (newLength + ALIGN_MASK) & ~ALIGN_MASK;
 
     /* replace an existing line */
-    if (FindLineN(buf, lineNumber, &line)) {
-        next = (uint8_t *)line + line->length;
-        spaceNeeded = newLength - line->length;
+    if (replace) {
+        oldLength = LineAt(buf, i)->length;
+        indexNeeded = 0;
     }
 
     /* insert a new line */
     else {
-        next = (uint8_t *)line;
-        spaceNeeded = newLength;
+        oldLength = 0;
+        indexNeeded = sizeof(int);
     }
+    spaceNeeded = newLength - oldLength;
 
     /* make sure there is enough space */
-    if (buf->buffer - spaceNeeded < buf->sys->nextLow)
+    if (buf->buffer - spaceNeeded - indexNeeded < buf->sys->nextLow)
         return VMFALSE;
-        
-    /* make space for the new line */
-    memmove(buf->buffer - spaceNeeded, buf->buffer, (uint8_t *)line - buf->buffer);
+
+    /* find the top of the lines that follow the new line */
+    next = buf->bufferTop - (i > 0 ? ((int *)buf->buffer)[i - 1] : 0) - oldLength;
+
+    /* make space for the new line by moving the index and the lines that follow it */
+    memmove(buf->buffer - spaceNeeded, buf->buffer, next - buf->buffer);
     buf->buffer -= spaceNeeded;
-    
-    /* adjust the line start */
-    line = (Line *)((uint8_t *)line - spaceNeeded);
 
-    /* insert the new line */
-    if (newLength > 0) {
-        line->lineNumber = lineNumber;
-        line->length = newLength;
-        strcpy(line->text, text);
+    /* add an index entry for a new line */
+    if (indexNeeded) {
+        memmove(buf->buffer - indexNeeded, buf->buffer, i * sizeof(int));
+        buf->buffer -= indexNeeded;
+        index = (int *)buf->buffer;
+        index[i] = i > 0 ? index[i - 1] : 0;
+        ++buf->lineCount;
     }
 
+    /* adjust the offsets of the new line and the lines that follow it */
+    index = (int *)buf->buffer;
+    for (j = i; j < buf->lineCount; ++j)
+        index[j] += spaceNeeded;
+
+    /* insert the new line */
+    line = LineAt(buf, i);
+    line->lineNumber = lineNumber;
+    line->length = newLength;
+    strcpy(line->text, crunched);
+
     /* return successfully */
     return VMTRUE;
 }
 
-static int BufDeleteLineN(EditBuf *buf, int lineNumber)
+/* crunch the lines starting at an index again until their block comment state is the same as before an edit */
+static int BufRecrunch(EditBuf *buf, int i, int oldInComment, int newInComment)
 {
-    int spaceFreed;
+    char text[MAXLINE], crunched[MAXLINE];
     Line *line;
+    for (; i < buf->lineCount && oldInComment != newInComment; ++i) {
+        line = LineAt(buf, i);
+        ExpandLine(line->text, text, sizeof(text), &oldInComment);
+        CrunchLine(text, crunched, sizeof(crunched), &newInComment);
+        if (!BufStoreLine(buf, i, VMTRUE, line->lineNumber, crunched))
+            return VMFALSE;
+    }
+    return VMTRUE;
+}
 
-    /* find the line to delete */
-    if (!FindLineN(buf, lineNumber, &line))
+/* find whether the line at an index starts in a block comment */
+static int BufCommentState(EditBuf *buf, int i)
+{
+    int inComment = VMFALSE;
+    int j;
+    for (j = 0; j < i; ++j)
+        inComment = LineCommentState(LineAt(buf, j)->text, inComment);
+    return inComment;
+}
+
+/* find whether a crunched line ends in a block comment */
+static int LineCommentState(const char *text, int inComment)
+{
+    char crunched[MAXLINE];
+    CrunchLine(text, crunched, sizeof(crunched), &inComment);
+    return inComment;
+}
+
+/* release everything but the edit buffer to make space for compiling or running a program */
+static void BufReserve(EditBuf *buf)
+{
+    ReleaseHighMemory(buf->sys, &buf->heapMark);
+    ReleaseLowMemory(buf->sys, &buf->heapMark);
+    AllocateHighMemory(buf->sys, buf->bufferTop - buf->buffer, HEAP_EDIT_BUFFER);
+}
+
+#ifdef LOAD_SAVE
+
+/* append a line without updating the index (used by LOAD before calling BufBuildIndex) */
+static int BufAppendLine(EditBuf *buf, int lineNumber, const char *text, int *pInComment)
+{
+    char crunched[MAXLINE];
+    int newLength;
+    Line *line;
+
+    /* lines are stored with their keywords crunched to single bytes */
+    newLength = sizeof(Line) + CrunchLine(text, crunched, sizeof(crunched), pInComment);
+
+    /* make sure the length is a multiple of the word size */
+    newLength = (newLength + ALIGN_MASK) & ~ALIGN_MASK;
+
+    /* make sure there is enough space */
+    if (buf->buffer - newLength < buf->sys->nextLow)
         return VMFALSE;
 
-    /* get a pointer to the next line */
-    spaceFreed = line->length;
+    /* store the line below the previous line */
+    buf->buffer -= newLength;
+    line = (Line *)buf->buffer;
+    line->lineNumber = lineNumber;
+    line->length = newLength;
+    strcpy(line->text, crunched);
+    ++buf->lineCount;
 
-    /* remove the line to be deleted */
-    memmove(buf->buffer + spaceFreed, buf->buffer, (uint8_t *)line - buf->buffer);
-    buf->buffer += spaceFreed;
+    /* return successfully */
+    return VMTRUE;
+}
+
+/* build the index for the lines stored by BufAppendLine */
+static int BufBuildIndex(EditBuf *buf)
+{
+    uint8_t *p = buf->buffer;
+    int *index;
+    int i;
+
+    /* make sure there is enough space */
+    if (buf->buffer - buf->lineCount * sizeof(int) < buf->sys->nextLow)
+        return VMFALSE;
+    buf->buffer -= buf->lineCount * sizeof(int);
+    index = (int *)buf->buffer;
+
+    /* the last line is at the bottom */
+    for (i = buf->lineCount; --i >= 0; ) {
+        index[i] = buf->bufferTop - p;
+        p += ((Line *)p)->length;
+    }
 
     /* return successfully */
     return VMTRUE;
 }
 
+#endif
+
 static int BufSeekN(EditBuf *buf, int lineNumber)
 {
     /* if the line number is zero start at the first line */
     if (lineNumber == 0)
-        buf->currentLine = (Line *)buf->buffer;
+        buf->currentLine = 0;
 
     /* otherwise, start at the specified line */
     else if (!FindLineN(buf, lineNumber, &buf->currentLine))
@@ -395,33 +824,41 @@ static int BufSeekN(EditBuf *buf, int lineNumber)
 
 static char *BufGetLine(EditBuf *buf, int *pLineNumber, char *text)
 {
+    Line *line;
+
     /* check for the end of the buffer */
-    if ((uint8_t *)buf->currentLine >= buf->bufferTop)
+    if (buf->currentLine >= buf->lineCount)
         return NULL;
 
     /* get the current line */
-    *pLineNumber = buf->currentLine->lineNumber;
-    strcpy(text, buf->currentLine->text);
+    line = LineAt(buf, buf->currentLine);
+    *pLineNumber = line->lineNumber;
+    strcpy(text, line->text);
 
     /* move ahead to the next line */
-    buf->currentLine = (Line *)((char *)buf->currentLine + buf->currentLine->length);
+    ++buf->currentLine;
 
     /* return successfully */
     return text;
 }
 
-static int FindLineN(EditBuf *buf, int lineNumber, Line **pLine)
+/* find a line or the index where it would be inserted using a binary search */
+static int FindLineN(EditBuf *buf, int lineNumber, int *pIndex)
 {
-    uint8_t *p = buf->buffer;
-    while (p < buf->bufferTop) {
-        Line *line = (Line *)p;
-        if (lineNumber <= line->lineNumber) {
-            *pLine = line;
-            return lineNumber == line->lineNumber;
-        }
-        p = p + line->length;
+    int lo = 0, hi = buf->lineCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (LineAt(buf, mid)->lineNumber < lineNumber)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    *pLine = (Line *)p;
-    return VMFALSE;
+    *pIndex = lo;
+    return lo < buf->lineCount && LineAt(buf, lo)->lineNumber == lineNumber;
 }
 
+/* get the line with an index */
+static Line *LineAt(EditBuf *buf, int i)
+{
+    return (Line *)(buf->bufferTop - ((int *)buf->buffer)[i]);
+}
@@ -51,10 +51,12 @@ static void code_loop_while_statement(GenerateContext *c, ParseTreeNode *node);
 static void code_loop_until_statement(GenerateContext *c, ParseTreeNode *node);
 static void code_return_statement(GenerateContext *c, ParseTreeNode *node);
 static void code_asm_statement(GenerateContext *c, ParseTreeNode *node);
-static void code_statement_list(GenerateContext *c, NodeListEntry *entry);
+static void code_statement_list(GenerateContext *c, ParseTreeNode **list);
 static void code_shortcircuit(GenerateContext *c, int op, ParseTreeNode *expr);
 static void code_call(GenerateContext *c, ParseTreeNode *expr);
 static void code_symbolRef(GenerateContext *c, Symbol *sym);
+static void code_stringRef(GenerateContext *c, String *str);
+static void code_literal(GenerateContext *c, VMVALUE value);
 static void code_arrayref(GenerateContext *c, ParseTreeNode *expr, PVAL *pv);
 static void code_index(GenerateContext *c, PValOp fcn, PVAL *pv);
 static void code_expr(GenerateContext *c, ParseTreeNode *expr, PVAL *pv);
@@ -64,19 +66,49 @@ static VMVALUE rd_cword(GenerateContext *c, VMUVALUE off);
 static void wr_cword(GenerateContext *c, VMUVALUE off, VMVALUE w);
 static void fixup(GenerateContext *c, VMUVALUE chn, VMUVALUE val);
 static void fixupbranch(GenerateContext *c, VMUVALUE chn, VMUVALUE val);
+static VMUVALUE RelocateChain(GenerateContext *c, VMUVALUE chain, VMVALUE delta, VMUVALUE tail);
 static VMVALUE AddSymbolRef(GenerateContext *c, Symbol *sym, VMUVALUE offset);
-static VMVALUE AddStringRef(GenerateContext *c, String *str);
+static VMVALUE AddStringRef(GenerateContext *c, String *str, VMUVALUE offset);
+static VMVALUE AddFragmentRef(GenerateContext *c, Symbol *sym, String *str, VMUVALUE offset);
+static int UsePool(GenerateContext *c);
+static int AddConstant(GenerateContext *c, VMVALUE value);
+static int AddRelocConstant(GenerateContext *c, Symbol *sym, String *str);
+static int FindConstant(GenerateContext *c, Symbol *sym, String *str, VMVALUE value);
+static int ConstantHash(Symbol *sym, String *str, VMVALUE value);
+static void LinkConstant(GenerateContext *c, int index);
+static void UnlinkConstant(GenerateContext *c, int index);
+static void PlaceConstants(GenerateContext *c, Symbol *sym, String *str, VMUVALUE offset);
+static void AddLine(GenerateContext *c, int lineNumber);
+static void AddLineEntry(GenerateContext *c, VMUVALUE offset, int lineNumber);
 static void GenerateError(GenerateContext *c, const char *fmt, ...);
 static void GenerateFatal(GenerateContext *c, const char *fmt, ...);
+static void AddFunctionInfo(GenerateContext *c, Symbol *symbol, VMVALUE code);
 
 /* InitGenerateContext - initialize a generate context */
 GenerateContext *InitGenerateContext(System *sys)
 {
     GenerateContext *g;
-    if (!(g = (GenerateContext *)AllocateHighMemory(sys, sizeof(GenerateContext))))
+    int i;
+    if (!(g = (GenerateContext *)AllocateHighMemory(sys, sizeof(GenerateContext), HEAP_COMPILER)))
+        return NULL;
+    MarkHeap(sys, &g->imageMark);
+    if (!(g->codeBuf = (uint8_t *)AllocateLowMemory(sys, sys->imageBufferSize, HEAP_CODE)))
         return NULL;
     g->sys = sys;
-    g->codeBuf = sys->nextLow;
+    g->codeTop = g->codeBuf + sys->imageBufferSize;
+    memset(g->codeBuf, 0, sizeof(ImageHdr));
+    g->codeFree = g->codeBuf + sizeof(ImageHdr);
+    g->constantCount = 0;
+    for (i = 0; i < CONSTANTBUCKETS; ++i)
+        g->constantBuckets[i] = -1;
+    g->lines = g->lastLine = NULL;
+    g->pNextLine = &g->lines;
+    g->lineCount = 0;
+    g->relocatable = VMFALSE;
+    g->fragment = NULL;
+    g->runtime = VMFALSE;
+    g->mainCode = g->mainChunk = 0;
+    g->mainChain = 0;
     functionCount = 0;
     return g;
 }
@@ -84,12 +116,96 @@ GenerateContext *InitGenerateContext(System *sys)
 /* Generate - generate code for a function */
 VMVALUE Generate(GenerateContext *c, ParseTreeNode *node)
 {
+    Phase phase = EnterPhase(c->sys, PHASE_GENERATE);
     VMVALUE code = codeaddr(c);
     PVAL pv;
     code_expr(c, node, &pv);
+    EnterPhase(c->sys, phase);
     return code;
 }
 
+/* GenerateMain - generate code for the main statements parsed so far */
+/* (the main code is generated a chunk at a time so each chunk's parse tree can be released) */
+void GenerateMain(GenerateContext *c, ParseTreeNode *node)
+{
+    Phase phase = EnterPhase(c->sys, PHASE_GENERATE);
+    
+    /* start the main code or resume it where the last chunk branched away */
+    if (!c->mainChunk) {
+        c->mainChunk = codeaddr(c);
+        if (c->mainCode)
+            fixupbranch(c, c->mainChain, c->mainChunk);
+        else {
+            c->mainCode = c->mainChunk;
+            putcbyte(c, OP_FRAME);
+            putcbyte(c, F_SIZE + node->u.functionDefinition.localOffset);
+        }
+    }
+    code_statement_list(c, node->u.functionDefinition.bodyStatements);
+    EnterPhase(c->sys, phase);
+}
+
+/* SuspendMain - branch around code generated between chunks of the main code */
+void SuspendMain(GenerateContext *c)
+{
+    if (c->mainChunk) {
+        putcbyte(c, OP_BR);
+        c->mainChain = putcword(c, 0);
+        AddFunctionInfo(c, NULL, c->mainChunk);
+        c->mainChunk = 0;
+    }
+}
+
+/* EndMain - generate the rest of the main code and return its starting offset */
+VMVALUE EndMain(GenerateContext *c, ParseTreeNode *node)
+{
+    GenerateMain(c, node);
+    putcbyte(c, OP_HALT);
+    AddFunctionInfo(c, NULL, c->mainChunk);
+    c->mainChunk = 0;
+    return c->mainCode;
+}
+
+/* GenerateFragment - generate a relocatable copy of a function after the code */
+/* (the copy has its own line table entries and reference chains and is discarded once saved) */
+void GenerateFragment(GenerateContext *c, ParseTreeNode *node, Fragment *f)
+{
+    LineEntry *lines = c->lines, **pNextLine = c->pNextLine, *lastLine = c->lastLine;
+    int lineCount = c->lineCount, relocatable = c->relocatable, savedFunctionCount = functionCount;
+    Phase phase = EnterPhase(c->sys, PHASE_GENERATE);
+    PVAL pv;
+    
+    /* start a separate line table and set of references for the fragment */
+    f->start = codeaddr(c);
+    f->refs = NULL;
+    c->lines = c->lastLine = NULL;
+    c->pNextLine = &c->lines;
+    c->lineCount = 0;
+    c->relocatable = VMTRUE;
+    c->fragment = f;
+    
+    /* generate the fragment */
+    code_expr(c, node, &pv);
+    f->lines = c->lines;
+    f->lineCount = c->lineCount;
+    
+    /* restore the generator state */
+    c->lines = lines;
+    c->pNextLine = pNextLine;
+    c->lastLine = lastLine;
+    c->lineCount = lineCount;
+    c->relocatable = relocatable;
+    c->fragment = NULL;
+    functionCount = savedFunctionCount;
+    EnterPhase(c->sys, phase);
+}
+
+/* DiscardFragment - remove the code of a fragment */
+void DiscardFragment(GenerateContext *c, Fragment *f)
+{
+    c->codeFree = c->codeBuf + f->start;
+}
+
 /* code_lvalue - generate code for an l-value expression */
 static void code_lvalue(GenerateContext *c, ParseTreeNode *expr, PVAL *pv)
 {
@@ -164,8 +280,7 @@ static void code_expr(GenerateContext *c, ParseTreeNode *expr, PVAL *pv)
         pv->u.val = -1 - expr->u.symbolRef.symbol->value;
         break;
     case NodeTypeStringLit:
-        putcbyte(c, OP_LIT);
-        putcword(c, AddStringRef(c, expr->u.stringLit.string));
+        code_stringRef(c, expr->u.stringLit.string);
         pv->fcn = GEN_NULL;
         break;
     case NodeTypeIntegerLit:
@@ -174,10 +289,8 @@ static void code_expr(GenerateContext *c, ParseTreeNode *expr, PVAL *pv)
             putcbyte(c, OP_SLIT);
             putcbyte(c, ival);
         }
-        else {
-            putcbyte(c, OP_LIT);
-            putcword(c, ival);
-        }
+        else
+            code_literal(c, ival);
         pv->fcn = GEN_NULL;
         break;
     case NodeTypeUnaryOp:
@@ -215,9 +328,6 @@ static void code_expr(GenerateContext *c, ParseTreeNode *expr, PVAL *pv)
 /* code_function_definition - generate code for a function definition */
 static void code_function_definition(GenerateContext *c, ParseTreeNode *node)
 {
-    System *sys = c->sys;
-    uint8_t *base = sys->nextLow;
-    size_t codeSize;
     VMVALUE code = codeaddr(c);
     putcbyte(c, OP_FRAME);
     putcbyte(c, F_SIZE + node->u.functionDefinition.localOffset);
@@ -226,13 +336,20 @@ static void code_function_definition(GenerateContext *c, ParseTreeNode *node)
         putcbyte(c, OP_RETURNZ);
     else
         putcbyte(c, OP_HALT);
-    codeSize = sys->nextLow - base;
     if (node->u.functionDefinition.symbol)
-        PlaceSymbol(c, node->u.functionDefinition.symbol, code);
-    functions[functionCount].symbol = node->u.functionDefinition.symbol;
-    functions[functionCount].code = code;
-    functions[functionCount].codeLen = codeSize;
-    ++functionCount;
+        DefineFunction(c, node->u.functionDefinition.symbol, code);
+    AddFunctionInfo(c, node->u.functionDefinition.symbol, code);
+}
+
+/* AddFunctionInfo - remember the code generated for a function for DumpFunctions */
+static void AddFunctionInfo(GenerateContext *c, Symbol *symbol, VMVALUE code)
+{
+    if (functionCount < sizeof(functions) / sizeof(functions[0])) {
+        functions[functionCount].symbol = symbol;
+        functions[functionCount].code = code;
+        functions[functionCount].codeLen = codeaddr(c) - code;
+        ++functionCount;
+    }
 }
 
 /* code_if_statement - generate code for an IF statement */
@@ -352,38 +469,39 @@ static void code_return_statement(GenerateContext *c, ParseTreeNode *node)
 /* code_asm_statement - generate code for an ASM statement */
 static void code_asm_statement(GenerateContext *c, ParseTreeNode *node)
 {
-    System *sys = c->sys;
     int length = node->u.asmStatement.length;
-    if (sys->nextLow + length > sys->nextHigh)
-        GenerateFatal(c, "insufficient memory");
-    memcpy(sys->nextLow, node->u.asmStatement.code, length);
-    sys->nextLow += length;
+    if (c->codeFree + length > c->codeTop)
+        GenerateFatal(c, "bytecode buffer overflow");
+    memcpy(c->codeFree, node->u.asmStatement.code, length);
+    c->codeFree += length;
 }
 
 /* code_statement_list - code a list of statements */
-static void code_statement_list(GenerateContext *c, NodeListEntry *entry)
+static void code_statement_list(GenerateContext *c, ParseTreeNode **list)
 {
-    while (entry) {
-        PVAL pv;
-        code_expr(c, entry->node, &pv);
-        entry = entry->next;
+    ParseTreeNode *node;
+    if (list) {
+        while ((node = *list++) != NULL) {
+            PVAL pv;
+            AddLine(c, node->lineNumber);
+            code_expr(c, node, &pv);
+        }
     }
 }
 
 /* code_shortcircuit - generate code for a conjunction or disjunction of boolean expressions */
 static void code_shortcircuit(GenerateContext *c, int op, ParseTreeNode *expr)
 {
-    NodeListEntry *entry = expr->u.exprList.exprs;
+    ParseTreeNode **list = expr->u.exprList.exprs;
     int end = 0;
 
-    code_rvalue(c, entry->node);
-    entry = entry->next;
+    code_rvalue(c, *list++);
 
     do {
         putcbyte(c, op);
         end = putcword(c, end);
-        code_rvalue(c, entry->node);
-    } while ((entry = entry->next) != NULL);
+        code_rvalue(c, *list++);
+    } while (*list != NULL);
 
     fixupbranch(c, end, codeaddr(c));
 }
@@ -391,11 +509,11 @@ static void code_shortcircuit(GenerateContext *c, int op, ParseTreeNode *expr)
 /* code_call - code a function call */
 static void code_call(GenerateContext *c, ParseTreeNode *expr)
 {
-    NodeListEntry *arg;
+    int i;
     
-    /* code each argument expression */
-    for (arg = expr->u.functionCall.args; arg != NULL; arg = arg->next)
-        code_rvalue(c, arg->node);
+    /* code each argument expression starting with the last */
+    for (i = expr->u.functionCall.argc; --i >= 0; )
+        code_rvalue(c, expr->u.functionCall.args[i]);
 
     /* get the value of the function */
     code_rvalue(c, expr->u.functionCall.fcn);
@@ -412,15 +530,83 @@ static void code_call(GenerateContext *c, ParseTreeNode *expr)
 static void code_symbolRef(GenerateContext *c, Symbol *sym)
 {
     VMUVALUE offset;
-    putcbyte(c, OP_LIT);
-    offset = codeaddr(c);
-    putcword(c, AddSymbolRef(c, sym, offset));
+    int index;
+    
+    /* references from a fragment stay on the fragment's own chains even if the symbol is placed */
+    if (c->fragment) {
+        putcbyte(c, OP_LIT);
+        offset = codeaddr(c);
+        putcword(c, AddFragmentRef(c, sym, NULL, offset));
+    }
+    
+    /* use the symbol value directly if it has already been placed */
+    else if (sym->placed)
+        code_literal(c, sym->value);
+        
+    /* otherwise, reference a constant pool entry that will be filled in when it is placed */
+    else if (UsePool(c) && (index = AddRelocConstant(c, sym, NULL)) >= 0) {
+        putcbyte(c, OP_KLIT);
+        putcbyte(c, index);
+    }
+    
+    /* fall back to an inline literal on the symbol's fixup chain if the pool is full */
+    /* (relocatable code always does this so the linker can relocate the reference) */
+    else {
+        putcbyte(c, OP_LIT);
+        offset = codeaddr(c);
+        putcword(c, AddSymbolRef(c, sym, offset));
+    }
+}
+
+/* code_stringRef - code a string reference */
+static void code_stringRef(GenerateContext *c, String *str)
+{
+    VMUVALUE offset;
+    int index;
+    
+    /* references from a fragment stay on the fragment's own chains */
+    if (c->fragment) {
+        putcbyte(c, OP_LIT);
+        offset = codeaddr(c);
+        putcword(c, AddFragmentRef(c, NULL, str, offset));
+    }
+    
+    /* use the string offset directly if it has already been placed */
+    else if (str->placed)
+        code_literal(c, str->value);
+        
+    /* otherwise, reference a constant pool entry that will be filled in when it is placed */
+    else if (UsePool(c) && (index = AddRelocConstant(c, NULL, str)) >= 0) {
+        putcbyte(c, OP_KLIT);
+        putcbyte(c, index);
+    }
+    
+    /* fall back to an inline literal on the string's fixup chain if the pool is full */
+    else {
+        putcbyte(c, OP_LIT);
+        offset = codeaddr(c);
+        putcword(c, AddStringRef(c, str, offset));
+    }
+}
+
+/* code_literal - code a literal value using the constant pool if possible */
+static void code_literal(GenerateContext *c, VMVALUE value)
+{
+    int index;
+    if (UsePool(c) && (index = AddConstant(c, value)) >= 0) {
+        putcbyte(c, OP_KLIT);
+        putcbyte(c, index);
+    }
+    else {
+        putcbyte(c, OP_LIT);
+        putcword(c, value);
+    }
 }
 
 /* code_arrayref - code an array reference */
 static void code_arrayref(GenerateContext *c, ParseTreeNode *expr, PVAL *pv)
 {
-    code_lvalue(c, expr->u.arrayRef.array, pv);
+    code_rvalue(c, expr->u.arrayRef.array);
     code_rvalue(c, expr->u.arrayRef.index);
     putcbyte(c, OP_INDEX);
     pv->fcn = code_index;
@@ -476,31 +662,39 @@ static void code_index(GenerateContext *c, PValOp fcn, PVAL *pv)
 /* codeaddr - get the current code address (actually, offset) */
 VMVALUE codeaddr(GenerateContext *c)
 {
-    return (VMVALUE)(c->sys->nextLow - c->codeBuf);
+    return (VMVALUE)(c->codeFree - c->codeBuf);
+}
+
+/* alignaddr - align the next free location in the image and return its offset */
+VMVALUE alignaddr(GenerateContext *c)
+{
+    VMUVALUE addr = (codeaddr(c) + ALIGN_MASK) & ~ALIGN_MASK;
+    if (c->codeBuf + addr > c->codeTop)
+        GenerateFatal(c, "bytecode buffer overflow");
+    c->codeFree = c->codeBuf + addr;
+    return addr;
 }
 
 /* putcbyte - put a code byte into the code buffer */
 VMVALUE putcbyte(GenerateContext *c, int b)
 {
-    System *sys = c->sys;
     VMVALUE addr = codeaddr(c);
-    if (sys->nextLow >= sys->nextHigh)
+    if (c->codeFree >= c->codeTop)
         GenerateFatal(c, "bytecode buffer overflow");
-    *sys->nextLow++ = b;
+    *c->codeFree++ = b;
     return addr;
 }
 
 /* putcword - put a code word into the code buffer */
 VMVALUE putcword(GenerateContext *c, VMVALUE w)
 {
-    System *sys = c->sys;
     VMVALUE addr = codeaddr(c);
     uint8_t *p;
     int cnt = sizeof(VMVALUE);
-    if (sys->nextLow + sizeof(VMVALUE) > sys->nextHigh)
+    if (c->codeFree + sizeof(VMVALUE) > c->codeTop)
         GenerateFatal(c, "bytecode buffer overflow");
-     sys->nextLow += sizeof(VMVALUE);
-     p = sys->nextLow;
+     c->codeFree += sizeof(VMVALUE);
+     p = c->codeFree;
      while (--cnt >= 0) {
         *--p = w;
         w >>= 8;
@@ -511,12 +705,11 @@ VMVALUE putcword(GenerateContext *c, VMVALUE w)
 /* putdword - put a code word into the code buffer */
 VMVALUE putdword(GenerateContext *c, VMVALUE w)
 {
-    System *sys = c->sys;
     VMVALUE addr = codeaddr(c);
-    if (sys->nextLow + sizeof(VMVALUE) > sys->nextHigh)
+    if (c->codeFree + sizeof(VMVALUE) > c->codeTop)
         GenerateFatal(c, "bytecode buffer overflow");
-    *((VMVALUE *)sys->nextLow) = w;
-    sys->nextLow += sizeof(VMVALUE);
+    *((VMVALUE *)c->codeFree) = w;
+    c->codeFree += sizeof(VMVALUE);
     return addr;
 }
 
@@ -584,32 +777,356 @@ void PlaceSymbol(GenerateContext *c, Symbol *sym, VMUVALUE offset)
         GenerateFatal(c, "Duplicate definition of '%s'", sym->name);
     else {
         fixup(c, sym->value, offset);
+        PlaceConstants(c, sym, NULL, offset);
         sym->placed = VMTRUE;
         sym->value = offset;
     }
 }
 
+/* DefineFunction - define a function at a code offset */
+void DefineFunction(GenerateContext *c, Symbol *sym, VMUVALUE offset)
+{
+    /* a fragment is a copy of a function that has already been defined */
+    /* and a function compiled at runtime is entered through its stub */
+    if (c->fragment || c->runtime)
+        return;
+        
+    /* functions in relocatable code are left unplaced so all references stay on the fixup chain */
+    if (c->relocatable) {
+        if (sym->definition)
+            GenerateFatal(c, "Duplicate definition of '%s'", sym->name);
+        sym->definition = offset;
+    }
+    else
+        PlaceSymbol(c, sym, offset);
+}
+
+/* GenerateStub - generate a stub that compiles a function when it is first called */
+VMVALUE GenerateStub(GenerateContext *c, Symbol *sym, int index)
+{
+    VMVALUE stub = codeaddr(c);
+    DefineFunction(c, sym, stub);
+    putcbyte(c, OP_LIT);
+    putcword(c, index);
+    putcbyte(c, OP_TRAP);
+    putcbyte(c, TRAP_CompileFunction);
+    return stub;
+}
+
+/* PatchStub - replace a stub with a branch to the compiled function */
+void PatchStub(GenerateContext *c, VMUVALUE stub, VMUVALUE code)
+{
+    c->codeBuf[stub] = OP_BR;
+    wr_cword(c, stub + 1, code - (stub + 1 + sizeof(VMUVALUE)));
+}
+
 /* AddStringRef - add a reference to a string in the string table */
-static VMVALUE AddStringRef(GenerateContext *c, String *str)
+static VMVALUE AddStringRef(GenerateContext *c, String *str, VMUVALUE offset)
+{
+    VMVALUE link;
+
+    /* handle strings that have already been placed */
+    if (str->placed)
+        return str->value;
+
+    /* add a new entry to the fixup list */
+    link = str->value;
+    str->value = offset;
+    return link;
+}
+
+/* AddFragmentRef - add a reference to a symbol or string from a fragment */
+static VMVALUE AddFragmentRef(GenerateContext *c, Symbol *sym, String *str, VMUVALUE offset)
+{
+    FragmentRef *ref;
+    VMVALUE link;
+    
+    /* find or add the fragment's chain for the symbol or string */
+    for (ref = c->fragment->refs; ref != NULL; ref = ref->next)
+        if (ref->symbol == sym && ref->string == str)
+            break;
+    if (!ref) {
+        ref = (FragmentRef *)AllocateHighMemory(c->sys, sizeof(FragmentRef), HEAP_CODE);
+        ref->symbol = sym;
+        ref->string = str;
+        ref->chain = 0;
+        ref->next = c->fragment->refs;
+        c->fragment->refs = ref;
+    }
+    
+    /* add a new entry to the fixup list */
+    link = ref->chain;
+    ref->chain = offset;
+    return link;
+}
+
+/* PlaceString - place a string in the image */
+void PlaceString(GenerateContext *c, String *str, VMUVALUE offset)
+{
+    fixup(c, str->value, offset);
+    PlaceConstants(c, NULL, str, offset);
+    str->placed = VMTRUE;
+    str->value = offset;
+}
+
+/* RelocateChain - relocate a fixup chain from an object module and link it to the end of another chain */
+/* (each link must be in the code of the module and before the previous one since chains are built */
+/* as the code is generated, so a damaged module can't cause references outside its code or a loop) */
+static VMUVALUE RelocateChain(GenerateContext *c, VMUVALUE chain, VMVALUE delta, VMUVALUE tail)
+{
+    VMUVALUE head, off, link;
+    if (chain == 0)
+        return tail;
+    head = chain + delta;
+    for (off = head; ; off = link) {
+        if (off < c->linkStart || off > c->linkEnd - sizeof(VMVALUE))
+            GenerateFatal(c, "invalid reference chain in object module");
+        if ((chain = rd_cword(c, off)) == 0) {
+            wr_cword(c, off, tail);
+            break;
+        }
+        if ((link = chain + delta) >= off)
+            GenerateFatal(c, "invalid reference chain in object module");
+        wr_cword(c, off, link);
+    }
+    return head;
+}
+
+/* LinkSymbolRefs - add the references to a symbol from an object module */
+void LinkSymbolRefs(GenerateContext *c, Symbol *sym, VMUVALUE chain, VMVALUE delta)
+{
+    if (sym->placed)
+        fixup(c, RelocateChain(c, chain, delta, 0), sym->value);
+    else
+        sym->value = RelocateChain(c, chain, delta, sym->value);
+}
+
+/* LinkStringRefs - add the references to a string from an object module */
+void LinkStringRefs(GenerateContext *c, String *str, VMUVALUE chain, VMVALUE delta)
+{
+    if (str->placed)
+        fixup(c, RelocateChain(c, chain, delta, 0), str->value);
+    else
+        str->value = RelocateChain(c, chain, delta, str->value);
+}
+
+/* UsePool - check whether references can use the constant pool */
+/* (relocatable code has no constant pool since it would have to be merged by the linker */
+/* and the pool of a running program has already been stored) */
+static int UsePool(GenerateContext *c)
+{
+    return !c->relocatable && !c->runtime;
+}
+
+/* AddConstant - find or add a literal value in the constant pool */
+static int AddConstant(GenerateContext *c, VMVALUE value)
 {
-    return (VMVALUE)((uint8_t *)str->data - c->codeBuf);
+    int i;
+    
+    /* check to see if the value is already in the pool */
+    if ((i = FindConstant(c, NULL, NULL, value)) >= 0)
+        return i;
+    
+    /* make sure there is room for another entry */
+    if (c->constantCount >= MAXCONSTANTS)
+        return -1;
+    
+    /* add a new entry */
+    i = c->constantCount++;
+    c->constants[i].symbol = NULL;
+    c->constants[i].string = NULL;
+    c->constants[i].value = value;
+    LinkConstant(c, i);
+    return i;
+}
+
+/* AddRelocConstant - find or add a constant pool entry for an unplaced symbol or string */
+static int AddRelocConstant(GenerateContext *c, Symbol *sym, String *str)
+{
+    int i;
+    
+    /* check to see if the symbol or string is already in the pool */
+    if ((i = FindConstant(c, sym, str, 0)) >= 0)
+        return i;
+    
+    /* make sure there is room for another entry */
+    if (c->constantCount >= MAXCONSTANTS)
+        return -1;
+    
+    /* add a new entry to be filled in by PlaceSymbol or PlaceString */
+    i = c->constantCount++;
+    c->constants[i].symbol = sym;
+    c->constants[i].string = str;
+    c->constants[i].value = 0;
+    LinkConstant(c, i);
+    return i;
+}
+
+/* PlaceConstants - fill in the constant pool entry for a symbol or string that has been placed */
+static void PlaceConstants(GenerateContext *c, Symbol *sym, String *str, VMUVALUE offset)
+{
+    int i;
+    if ((i = FindConstant(c, sym, str, 0)) >= 0) {
+        UnlinkConstant(c, i);
+        c->constants[i].symbol = NULL;
+        c->constants[i].string = NULL;
+        c->constants[i].value = offset;
+        LinkConstant(c, i);
+    }
+}
+
+/* FindConstant - find the first constant pool entry for a symbol, string or (if both are NULL) value */
+static int FindConstant(GenerateContext *c, Symbol *sym, String *str, VMVALUE value)
+{
+    Constant *k;
+    int i;
+    for (i = c->constantBuckets[ConstantHash(sym, str, value)]; i >= 0; i = k->hashNext) {
+        k = &c->constants[i];
+        if (k->symbol == sym && k->string == str && (sym || str || k->value == value))
+            return i;
+    }
+    return -1;
+}
+
+/* ConstantHash - get the hash chain for a symbol, string or value */
+static int ConstantHash(Symbol *sym, String *str, VMVALUE value)
+{
+    uint32_t h = sym ? (uint32_t)(uintptr_t)sym : str ? (uint32_t)(uintptr_t)str : (uint32_t)value;
+    return (int)((h * 0x9e3779b1u) >> 16) & (CONSTANTBUCKETS - 1);
+}
+
+/* LinkConstant - add a constant pool entry to its hash chain */
+/* (chains are kept in pool order so a lookup finds the same entry a scan of the pool would) */
+static void LinkConstant(GenerateContext *c, int index)
+{
+    Constant *k = &c->constants[index];
+    int *pNext = &c->constantBuckets[ConstantHash(k->symbol, k->string, k->value)];
+    while (*pNext >= 0 && *pNext < index)
+        pNext = &c->constants[*pNext].hashNext;
+    k->hashNext = *pNext;
+    *pNext = index;
+}
+
+/* UnlinkConstant - remove a constant pool entry from its hash chain */
+static void UnlinkConstant(GenerateContext *c, int index)
+{
+    Constant *k = &c->constants[index];
+    int *pNext = &c->constantBuckets[ConstantHash(k->symbol, k->string, k->value)];
+    while (*pNext != index)
+        pNext = &c->constants[*pNext].hashNext;
+    *pNext = k->hashNext;
+}
+
+/* StoreConstants - store the constant pool in the space reserved for it */
+void StoreConstants(GenerateContext *c, VMUVALUE offset)
+{
+    VMVALUE *p = (VMVALUE *)(c->codeBuf + offset);
+    int i;
+    for (i = 0; i < c->constantCount; ++i)
+        *p++ = c->constants[i].value;
+}
+
+/* AddLine - add a line table entry for the code at the current offset */
+static void AddLine(GenerateContext *c, int lineNumber)
+{
+    /* the line table of a running program has already been stored */
+    if (!c->runtime)
+        AddLineEntry(c, codeaddr(c), lineNumber);
+}
+
+/* AddLineEntry - add a line table entry */
+static void AddLineEntry(GenerateContext *c, VMUVALUE offset, int lineNumber)
+{
+    LineEntry *line;
+    
+    /* nothing to do if the code is still part of the same line */
+    if (c->lastLine && c->lastLine->lineNumber == lineNumber)
+        return;
+        
+    /* a line that generated no code is replaced by the one that follows it */
+    if (c->lastLine && c->lastLine->offset == offset) {
+        c->lastLine->lineNumber = lineNumber;
+        return;
+    }
+    
+    /* add a new line table entry (fragment entries are only needed until the fragment is saved) */
+    if (c->fragment)
+        line = (LineEntry *)AllocateHighMemory(c->sys, sizeof(LineEntry), HEAP_CODE);
+    else
+        line = (LineEntry *)AllocateLowMemory(c->sys, sizeof(LineEntry), HEAP_CODE);
+    line->offset = offset;
+    line->lineNumber = lineNumber;
+    line->next = NULL;
+    *c->pNextLine = line;
+    c->pNextLine = &line->next;
+    c->lastLine = line;
+    ++c->lineCount;
+}
+
+/* LinkLines - add the line table entries from an object module */
+void LinkLines(GenerateContext *c, const ImageLine *lines, int count, VMVALUE delta)
+{
+    int i;
+    for (i = 0; i < count; ++i)
+        AddLineEntry(c, lines[i].offset + delta, lines[i].lineNumber);
+}
+
+/* StoreLines - store the line table */
+VMVALUE StoreLines(GenerateContext *c)
+{
+    VMVALUE addr;
+    LineEntry *line;
+    
+    /* end the last line so code added after the image has no line number */
+    AddLine(c, 0);
+    
+    addr = alignaddr(c);
+    for (line = c->lines; line != NULL; line = line->next) {
+        putdword(c, line->offset);
+        putdword(c, line->lineNumber);
+    }
+    return addr;
+}
+
+/* ReserveSpace - reserve a zero-filled word aligned area in the image */
+VMVALUE ReserveSpace(GenerateContext *c, int size)
+{
+    VMVALUE addr = alignaddr(c);
+    if (c->codeFree + size > c->codeTop)
+        GenerateFatal(c, "bytecode buffer overflow");
+    memset(c->codeFree, 0, size);
+    c->codeFree += size;
+    return addr;
+}
+
+/* StoreCode - store the code from an object module */
+VMVALUE StoreCode(GenerateContext *c, const uint8_t *code, int size)
+{
+    /* code without line table entries of its own has no line numbers */
+    AddLine(c, 0);
+    
+    /* remember where the code went so its reference chains can be checked */
+    c->linkStart = StoreByteVector(c, code, size);
+    c->linkEnd = c->linkStart + size;
+    return c->linkStart;
 }
 
 /* StoreVector - store a VMVALUE vector */
 VMVALUE StoreVector(GenerateContext *c, const VMVALUE *buf, int size)
 {
+    alignaddr(c);
     return StoreByteVector(c, (uint8_t *)buf, size * sizeof(VMVALUE));
 }
 
 /* StoreByteVector - store a byte vector */
 VMVALUE StoreByteVector(GenerateContext *c, const uint8_t *buf, int size)
 {
-    System *sys = c->sys;
-    uint8_t *p;
-    if (!(p = AllocateLowMemory(sys, size)))
-        return 0;
-    memcpy(p, buf, size);
-    return p - sys->freeSpace;
+    VMVALUE addr = codeaddr(c);
+    if (c->codeFree + size > c->codeTop)
+        GenerateFatal(c, "bytecode buffer overflow");
+    memcpy(c->codeFree, buf, size);
+    c->codeFree += size;
+    return addr;
 }
 
 /* DumpFunctions - dump function definitions */
@@ -623,6 +1140,23 @@ void DumpFunctions(GenerateContext *c)
     }
 }
 
+/* DumpConstants - dump the constant pool */
+void DumpConstants(GenerateContext *c)
+{
+    int i;
+    if (c->constantCount > 0) {
+        VM_printf("Constants:\n");
+        for (i = 0; i < c->constantCount; ++i) {
+            if (c->constants[i].symbol)
+                VM_printf("  %02x %s <undefined>\n", i, c->constants[i].symbol->name);
+            else if (c->constants[i].string)
+                VM_printf("  %02x '%s' <unplaced>\n", i, c->constants[i].string->data);
+            else
+                VM_printf("  %02x %08x\n", i, c->constants[i].value);
+        }
+    }
+}
+
 /* GenerateError - report a code generation error */
 static void GenerateError(GenerateContext *c, const char *fmt, ...)
 {
@@ -642,4 +1176,5 @@ static void GenerateFatal(GenerateContext *c, const char *fmt, ...)
     VM_vprintf(fmt, ap);
     VM_putchar('\n');
     va_end(ap);
+    longjmp(c->sys->errorTarget, 1);
 }
@@ -0,0 +1,146 @@
+/* image.c - compiled image file routines
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "image.h"
+
+/* local function prototypes */
+static int CheckImageHdr(ImageHdr *hdr);
+static int CheckImageSymbols(uint8_t *image);
+static int InImage(ImageHdr *hdr, VMUVALUE offset, VMUVALUE count, VMUVALUE size);
+
+/* SaveImage - write an image to a file */
+int SaveImage(const char *name, uint8_t *image)
+{
+    ImageHdr *hdr = (ImageHdr *)image;
+    VMFILE *fp;
+    int sts;
+
+    if (!(fp = VM_fopen(name, "wb")))
+        return VMFALSE;
+
+    sts = VM_fwrite(image, 1, hdr->imageSize, fp) == hdr->imageSize;
+    VM_fclose(fp);
+
+    return sts;
+}
+
+/* MapImage - map an image file into memory ready to execute */
+uint8_t *MapImage(System *sys, const char *name)
+{
+    ImageHdr hdr;
+    uint8_t *image;
+    VMFILE *fp;
+
+    /* read the image header */
+    if (!(fp = VM_fopen(name, "rb")))
+        return NULL;
+    if (VM_fread(&hdr, 1, sizeof(ImageHdr), fp) != sizeof(ImageHdr)) {
+        VM_fclose(fp);
+        return NULL;
+    }
+    VM_fclose(fp);
+
+    /* make sure the image was built for this virtual machine */
+    if (!CheckImageHdr(&hdr))
+        return NULL;
+
+    /* map the image and its bss (this fails if the file is shorter than the image) */
+    if (!(image = VM_mapimage(sys, name, hdr.imageSize, hdr.imageSize + hdr.bssSize)))
+        return NULL;
+    
+    /* make sure the symbol export table is entirely within the image */
+    if (!CheckImageSymbols(image)) {
+        UnmapImage(image);
+        return NULL;
+    }
+
+    /* return the image */
+    return image;
+}
+
+/* UnmapImage - release an image mapped by MapImage */
+void UnmapImage(uint8_t *image)
+{
+    ImageHdr *hdr = (ImageHdr *)image;
+    VM_unmapimage(image, hdr->imageSize + hdr->bssSize);
+}
+
+/* CheckImageHdr - check that an image header is valid for this virtual machine */
+static int CheckImageHdr(ImageHdr *hdr)
+{
+    return hdr->magic == IMAGE_MAGIC
+        && hdr->version == IMAGE_VERSION
+        && hdr->wordSize == sizeof(VMVALUE)
+        && hdr->imageSize >= sizeof(ImageHdr)
+        && hdr->bssSize <= ~(VMUVALUE)0 - hdr->imageSize
+        && hdr->codeOffset >= sizeof(ImageHdr)
+        && InImage(hdr, hdr->codeOffset, hdr->codeSize, 1)
+        && hdr->entry >= hdr->codeOffset && hdr->entry - hdr->codeOffset < hdr->codeSize
+        && InImage(hdr, hdr->stringsOffset, hdr->stringsSize, 1)
+        && InImage(hdr, hdr->dataOffset, hdr->dataSize, 1)
+        && InImage(hdr, hdr->linesOffset, hdr->lineCount, sizeof(ImageLine))
+        && InImage(hdr, hdr->symbolsOffset, 0, 1)
+        && InImage(hdr, hdr->constantsOffset, hdr->constantCount, sizeof(VMVALUE));
+}
+
+/* CheckImageSymbols - check that each symbol export table entry is within the image */
+static int CheckImageSymbols(uint8_t *image)
+{
+    ImageHdr *hdr = (ImageHdr *)image;
+    VMUVALUE offset = hdr->symbolsOffset, i;
+    ImageSymbol *symbol;
+    char *end;
+    for (i = 0; i < hdr->symbolCount; ++i) {
+        if (!InImage(hdr, offset, offsetof(ImageSymbol, name) + 1, 1))
+            return VMFALSE;
+        symbol = (ImageSymbol *)(image + offset);
+        if (!(end = memchr(symbol->name, '\0', hdr->imageSize - offset - offsetof(ImageSymbol, name))))
+            return VMFALSE;
+        offset += ImageSymbolSize(end - symbol->name);
+    }
+    return offset <= hdr->imageSize;
+}
+
+/* InImage - check that a segment of count items of a size is within the image (without overflowing) */
+static int InImage(ImageHdr *hdr, VMUVALUE offset, VMUVALUE count, VMUVALUE size)
+{
+    return offset <= hdr->imageSize && count <= (hdr->imageSize - offset) / size;
+}
+
+/* FindImageSymbol - find an exported symbol in an image */
+ImageSymbol *FindImageSymbol(uint8_t *image, const char *name)
+{
+    ImageHdr *hdr = (ImageHdr *)image;
+    uint8_t *p = image + hdr->symbolsOffset;
+    VMUVALUE i;
+    for (i = 0; i < hdr->symbolCount; ++i) {
+        ImageSymbol *symbol = (ImageSymbol *)p;
+        if (strcasecmp(name, symbol->name) == 0)
+            return symbol;
+        p += ImageSymbolSize(strlen(symbol->name));
+    }
+    return NULL;
+}
+
+/* FindImageLine - find the source line containing a code offset (zero if unknown) */
+int FindImageLine(uint8_t *image, VMUVALUE offset)
+{
+    ImageHdr *hdr = (ImageHdr *)image;
+    ImageLine *lines = (ImageLine *)(image + hdr->linesOffset);
+    VMUVALUE lo = 0, hi = hdr->lineCount;
+
+    /* find the last entry at or before the offset */
+    while (lo < hi) {
+        VMUVALUE mid = (lo + hi) / 2;
+        if (lines[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 ? (int)lines[lo - 1].lineNumber : 0;
+}
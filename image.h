@@ -8,7 +8,9 @@
 #define __IMAGE_H__
 
 #include <stdarg.h>
+#include <stddef.h>
 #include "types.h"
+#include "system.h"
 
 /* get the size of an object in words */
 #define GetObjSizeInWords(s)    (((s) + sizeof(VMVALUE) - 1) / sizeof(VMVALUE))
@@ -18,6 +20,97 @@
 /* nothing */
 #define NIL             (VMVALUE)0
 
+/* image file identification */
+#define IMAGE_MAGIC     0x4a42494d      /* 'JBIM' */
+#define IMAGE_VERSION   1
+
+/* image header (at offset zero of the image) */
+/* the segments follow the header in this order and the bss follows the image */
+/* an image file is an exact copy of the image so it can be mapped directly into memory */
+typedef struct {
+    VMUVALUE magic;             /* IMAGE_MAGIC (also detects a byte order mismatch) */
+    VMUVALUE version;           /* IMAGE_VERSION */
+    VMUVALUE wordSize;          /* sizeof(VMVALUE) of the compiler that built the image */
+    VMUVALUE entry;             /* offset to the main code */
+    VMUVALUE codeOffset;        /* code segment */
+    VMUVALUE codeSize;
+    VMUVALUE stringsOffset;     /* read-only string segment */
+    VMUVALUE stringsSize;
+    VMUVALUE dataOffset;        /* initialized data segment */
+    VMUVALUE dataSize;
+    VMUVALUE linesOffset;       /* line table */
+    VMUVALUE lineCount;
+    VMUVALUE symbolsOffset;     /* symbol export table */
+    VMUVALUE symbolCount;
+    VMUVALUE constantsOffset;   /* constant pool */
+    VMUVALUE constantCount;
+    VMUVALUE imageSize;         /* total size of the image */
+    VMUVALUE bssSize;           /* size of the zero-initialized data (not stored in the image) */
+} ImageHdr;
+
+/* line table entry (entries are sorted by code offset) */
+typedef struct {
+    VMUVALUE offset;            /* offset of the first instruction of a source line */
+    VMUVALUE lineNumber;        /* source line number */
+} ImageLine;
+
+/* symbol export table entry (entries are word aligned) */
+typedef struct {
+    VMUVALUE value;             /* offset of a function, variable or array */
+    uint8_t kind;               /* EXPORT_xxx */
+    char name[1];               /* zero terminated symbol name */
+} ImageSymbol;
+
+/* exported symbol kinds */
+#define EXPORT_FUNCTION 1
+#define EXPORT_VARIABLE 2
+#define EXPORT_ARRAY    3
+
+/* get the size of a symbol export table entry */
+#define ImageSymbolSize(n)      ((offsetof(ImageSymbol, name) + (n) + 1 + ALIGN_MASK) & ~ALIGN_MASK)
+
+/* object module identification */
+#define OBJECT_MAGIC    0x4a424f42      /* 'JBOB' */
+#define OBJECT_VERSION  2
+
+/* object module header */
+/* the relocatable code follows the header and is followed by the string, symbol and line records */
+/* references to strings and symbols are left on fixup chains through the code for the linker */
+typedef struct {
+    VMUVALUE magic;             /* OBJECT_MAGIC (also detects a byte order mismatch) */
+    VMUVALUE version;           /* OBJECT_VERSION */
+    VMUVALUE wordSize;          /* sizeof(VMVALUE) of the compiler that built the module */
+    VMUVALUE codeBase;          /* offset the code was generated at (chains are relative to this) */
+    VMUVALUE codeSize;
+    VMUVALUE stringCount;
+    VMUVALUE symbolCount;
+    VMUVALUE lineCount;         /* number of ImageLine records (offsets are relative to codeBase) */
+    VMUVALUE objectSize;        /* total size of the object module */
+} ObjectHdr;
+
+/* object module string record (records are word aligned) */
+typedef struct {
+    VMUVALUE chain;             /* fixup chain of references to the string */
+    char data[1];               /* zero terminated string */
+} ObjectString;
+
+/* object module symbol record (followed by the initial values of initialized data) */
+typedef struct {
+    VMUVALUE chain;             /* fixup chain of references to the symbol */
+    VMUVALUE value;             /* code offset of a function or size of data in words */
+    uint8_t kind;               /* EXPORT_xxx or zero for an unresolved symbol */
+    uint8_t flags;              /* OBJECT_xxx */
+    char name[1];               /* zero terminated symbol name */
+} ObjectSymbol;
+
+/* object module symbol flags */
+#define OBJECT_DEFINED      0x01    /* defined in this module */
+#define OBJECT_INITIALIZED  0x02    /* initial values follow the record */
+
+/* get the size of object module records */
+#define ObjectStringSize(n)     ((offsetof(ObjectString, data) + (n) + 1 + ALIGN_MASK) & ~ALIGN_MASK)
+#define ObjectSymbolSize(n)     ((offsetof(ObjectSymbol, name) + (n) + 1 + ALIGN_MASK) & ~ALIGN_MASK)
+
 /* opcodes */
 #define OP_HALT         0x00    /* halt */
 #define OP_BRT          0x01    /* branch on true */
@@ -61,6 +154,7 @@
 #define OP_NATIVE       0x27    /* execute native code */
 #define OP_TRAP         0x28    /* trap to handler */
 #define OP_RETURNZ      0x29
+#define OP_KLIT         0x2a    /* load a literal from the constant pool */
 #define OP_CLEAN        0x2c
 
 /* VM trap codes */
@@ -72,6 +166,14 @@ enum {
     TRAP_PrintTab     = 4,
     TRAP_PrintNL      = 5,
     TRAP_PrintFlush   = 6,
+    TRAP_CompileFunction = 7,
 };
 
+/* image.c */
+int SaveImage(const char *name, uint8_t *image);
+uint8_t *MapImage(System *sys, const char *name);
+void UnmapImage(uint8_t *image);
+ImageSymbol *FindImageSymbol(uint8_t *image, const char *name);
+int FindImageLine(uint8_t *image, VMUVALUE offset);
+
 #endif
@@ -0,0 +1,176 @@
+/* junkbasic.c - interface for programs that embed the compiler and virtual machine
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ * The JunkBasic structure sits in high memory at the top of the workspace.
+ * The image of the compiled program and the interpreter stack stay in low
+ * memory after the compiler's high memory is released.
+ *
+ */
+
+#include "junkbasic.h"
+#include "compile.h"
+#include "vmint.h"
+
+#define STACKSIZE   1024        /* interpreter stack size in words */
+#define MAXARGS     255         /* must fit in the byte operand of OP_CLEAN */
+
+/* source text being compiled */
+typedef struct {
+    const char *next;           /* start of the next line */
+    int lineNumber;             /* number of the last line read */
+} Source;
+
+/* compiler and virtual machine in a workspace */
+struct JunkBasic {
+    System *sys;                /* system context at the start of the workspace */
+    HeapMark mark;              /* heap with nothing compiled */
+    uint8_t *image;             /* image of the compiled program or NULL */
+    Interpreter *interpreter;   /* interpreter for the image */
+    Source source;              /* source text being compiled */
+};
+
+/* local function prototypes */
+static ImageSymbol *FindSymbol(JunkBasic *jb, const char *name);
+static char *GetSourceLine(char *buf, int len, int *pLineNumber, void *cookie);
+
+/* JB_Init - initialize a compiler and virtual machine in a workspace */
+JunkBasic *JB_Init(void *workspace, size_t size)
+{
+    JunkBasic *jb;
+    System *sys;
+
+    if (!(sys = InitSystem((uint8_t *)workspace, size)))
+        return NULL;
+    sys->imageBufferSize = size / 4 < HOSTIMAGESIZE ? size / 4 : HOSTIMAGESIZE;
+    sys->diagnostics = DIAG_QUIET;
+
+    /* AllocateHighMemory aborts if there isn't enough memory */
+    if (setjmp(sys->errorTarget) != 0)
+        return NULL;
+    jb = (JunkBasic *)AllocateHighMemory(sys, sizeof(JunkBasic), HEAP_COMPILER);
+    jb->sys = sys;
+    jb->image = NULL;
+    jb->interpreter = NULL;
+    MarkHeap(sys, &jb->mark);
+
+    return jb;
+}
+
+/* JB_Compile - compile a program from a zero terminated string replacing any previous program */
+int JB_Compile(JunkBasic *jb, const char *source)
+{
+    System *sys = jb->sys;
+    ParseContext *c;
+
+    /* release the previous program */
+    ReleaseHighMemory(sys, &jb->mark);
+    ReleaseLowMemory(sys, &jb->mark);
+    jb->image = NULL;
+    jb->interpreter = NULL;
+
+    /* the main source is the string */
+    jb->source.next = source;
+    jb->source.lineNumber = 0;
+    SetMainSource(sys, GetSourceLine, &jb->source);
+
+    /* compile the program (the compiler's high memory isn't needed once the image is loaded) */
+    if (setjmp(sys->errorTarget) == 0) {
+        StartTiming(sys);
+        if ((c = InitCompileContext(sys)) != NULL && (jb->image = Compile(c)) != NULL) {
+            ReleaseHighMemory(sys, &jb->mark);
+            
+            /* the interpreter keeps its stack from one call to the next */
+            if (setjmp(sys->errorTarget) == 0
+            &&  (jb->interpreter = InitInterpreter(sys, jb->image, STACKSIZE)) != NULL)
+                return VMTRUE;
+        }
+    }
+
+    /* release what was compiled */
+    ReleaseHighMemory(sys, &jb->mark);
+    ReleaseLowMemory(sys, &jb->mark);
+    jb->image = NULL;
+    jb->interpreter = NULL;
+    return VMFALSE;
+}
+
+/* JB_Run - run the main code of the compiled program */
+int JB_Run(JunkBasic *jb)
+{
+    if (!jb->interpreter)
+        return VMFALSE;
+    return Execute(jb->interpreter, ((ImageHdr *)jb->image)->entry);
+}
+
+/* JB_FindFunction - find a function in the compiled program */
+JB_Symbol JB_FindFunction(JunkBasic *jb, const char *name)
+{
+    ImageSymbol *symbol = FindSymbol(jb, name);
+    return symbol && symbol->kind == EXPORT_FUNCTION ? (JB_Symbol)symbol->value : 0;
+}
+
+/* JB_Call - call a function with the number of arguments it takes and get the value it returns */
+int JB_Call(JunkBasic *jb, JB_Symbol function, int argc, const long *argv, long *pResult)
+{
+    VMVALUE args[MAXARGS], result;
+    int n;
+
+    if (!jb->interpreter || function == 0 || argc < 0 || argc > MAXARGS)
+        return VMFALSE;
+    for (n = 0; n < argc; ++n)
+        args[n] = (VMVALUE)argv[n];
+    if (!CallFunction(jb->interpreter, (VMVALUE)function, argc, args, &result))
+        return VMFALSE;
+    if (pResult)
+        *pResult = result;
+    return VMTRUE;
+}
+
+/* JB_FindGlobal - find a global variable or array in the compiled program */
+JB_Symbol JB_FindGlobal(JunkBasic *jb, const char *name)
+{
+    ImageSymbol *symbol = FindSymbol(jb, name);
+    return symbol && (symbol->kind == EXPORT_VARIABLE || symbol->kind == EXPORT_ARRAY) ? (JB_Symbol)symbol->value : 0;
+}
+
+/* JB_GetGlobal - get the value of a global variable or an element of a global array */
+/* (the index is zero for a variable and isn't checked against the size of an array) */
+long JB_GetGlobal(JunkBasic *jb, JB_Symbol global, int index)
+{
+    return ((VMVALUE *)(jb->image + global))[index];
+}
+
+/* JB_SetGlobal - set the value of a global variable or an element of a global array */
+void JB_SetGlobal(JunkBasic *jb, JB_Symbol global, int index, long value)
+{
+    ((VMVALUE *)(jb->image + global))[index] = (VMVALUE)value;
+}
+
+/* FindSymbol - find an exported symbol in the compiled program */
+static ImageSymbol *FindSymbol(JunkBasic *jb, const char *name)
+{
+    return jb->image ? FindImageSymbol(jb->image, name) : NULL;
+}
+
+/* GetSourceLine - get the next line of the source text */
+static char *GetSourceLine(char *buf, int len, int *pLineNumber, void *cookie)
+{
+    Source *source = (Source *)cookie;
+    const char *p = source->next;
+    int i = 0;
+
+    if (*p == '\0')
+        return NULL;
+
+    /* copy the line including its newline (a long line is split like fgets would) */
+    while (*p != '\0' && i < len - 1) {
+        if ((buf[i++] = *p++) == '\n')
+            break;
+    }
+    buf[i] = '\0';
+
+    source->next = p;
+    *pLineNumber = ++source->lineNumber;
+    return buf;
+}
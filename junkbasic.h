@@ -0,0 +1,41 @@
+/* junkbasic.h - interface for programs that embed the compiler and virtual machine
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ * A program is compiled once from a buffer in memory and its functions can
+ * then be called any number of times. The main code only runs if JB_Run is
+ * called. Everything lives in a workspace supplied by the caller and
+ * compiling another program replaces the one that was there. Error messages
+ * are written to stdout.
+ *
+ */
+
+#ifndef __JUNKBASIC_H__
+#define __JUNKBASIC_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a compiler and virtual machine in a workspace */
+typedef struct JunkBasic JunkBasic;
+
+/* a function or global variable found in a compiled program (zero if it wasn't found) */
+typedef unsigned long JB_Symbol;
+
+JunkBasic *JB_Init(void *workspace, size_t size);
+int JB_Compile(JunkBasic *jb, const char *source);
+int JB_Run(JunkBasic *jb);
+JB_Symbol JB_FindFunction(JunkBasic *jb, const char *name);
+int JB_Call(JunkBasic *jb, JB_Symbol function, int argc, const long *argv, long *pResult);
+JB_Symbol JB_FindGlobal(JunkBasic *jb, const char *name);
+long JB_GetGlobal(JunkBasic *jb, JB_Symbol global, int index);
+void JB_SetGlobal(JunkBasic *jb, JB_Symbol global, int index, long value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
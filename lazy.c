@@ -0,0 +1,156 @@
+/* lazy.c - compile functions when they are first called
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ * In lazy mode, the compiler only parses the FUNCTION statement of each function
+ * definition and generates a stub for it. The first call to the stub traps to the
+ * compiler, which parses the body from the source, generates its code after the
+ * bss of the running program and patches the stub to branch to it.
+ *
+ */
+
+#include <stdlib.h>
+#include "compile.h"
+
+/* local function prototypes */
+static void SkipFunctionBody(ParseContext *c);
+static void ReopenFile(ParseContext *c, LazyFunction *f);
+static void PlaceRuntimeSymbols(ParseContext *c);
+
+/* AddLazyFunction - add a stub for a function and skip over its body */
+void AddLazyFunction(ParseContext *c, Symbol *symbol)
+{
+    LazyFunction *f;
+
+    /* remember where the function is defined */
+    if (!(f = (LazyFunction *)AllocateHighMemory(c->sys, sizeof(LazyFunction), HEAP_COMPILER)))
+        Abort(c->sys, "insufficient memory");
+    f->symbol = symbol;
+    f->file = c->currentFile ? c->currentFile->file : NULL;
+    f->lineNumber = c->lineNumber;
+    f->index = ++c->lazyFunctionCount;
+    f->next = c->lazyFunctions;
+    c->lazyFunctions = f;
+
+    /* generate the stub that calls the compiler */
+    f->stub = GenerateStub(c->g, symbol, f->index);
+
+    /* skip to the end of the function definition */
+    SkipFunctionBody(c);
+}
+
+/* FindLazyFunction - find a function by the index in its stub */
+LazyFunction *FindLazyFunction(ParseContext *c, VMVALUE index)
+{
+    LazyFunction *f;
+    for (f = c->lazyFunctions; f != NULL; f = f->next)
+        if (f->index == index)
+            return f;
+    return NULL;
+}
+
+/* CompileLazyFunction - compile a function for a running program */
+/* (a function in the main source is read from the current main source line) */
+VMVALUE CompileLazyFunction(ParseContext *c, LazyFunction *f)
+{
+    System *sys = c->sys;
+    GenerateContext *g = c->g;
+    HeapMark mark;
+    VMVALUE code;
+    Phase phase;
+    int tkn;
+
+    /* the parse tree is released after the code is generated */
+    MarkHeap(sys, &mark);
+    phase = EnterPhase(sys, PHASE_PARSE);
+
+    /* open the file containing the definition */
+    if (f->file)
+        ReopenFile(c, f);
+
+    /* parse the FUNCTION statement */
+    c->compilingFunction = f;
+    tkn = ParseGetLine(c) ? GetToken(c) : T_EOF;
+    if (tkn != T_FUNCTION)
+        Abort(sys, "can't find the definition of '%s'", f->symbol->name);
+    ParseStatement(c, tkn);
+
+    /* parse the body (the code is generated by END FUNCTION) */
+    code = codeaddr(g);
+    while (c->currentFunction != c->mainFunction) {
+        if (!ParseGetLine(c))
+            Abort(sys, "missing END FUNCTION in '%s'", f->symbol->name);
+        if ((tkn = GetToken(c)) != T_EOL)
+            ParseStatement(c, tkn);
+    }
+    c->compilingFunction = NULL;
+
+    /* close the file containing the definition */
+    if (c->currentFile) {
+        CloseParseFile(c->currentFile);
+        c->currentFile = NULL;
+    }
+
+    /* place any strings or variables that weren't in the image */
+    EnterPhase(sys, PHASE_LINK);
+    PlaceRuntimeSymbols(c);
+
+    /* branch to the code from the stub the next time it is called */
+    PatchStub(g, f->stub, code);
+    EnterPhase(sys, phase);
+
+    /* the parse tree is no longer needed */
+    ReleaseHighMemory(sys, &mark);
+
+    return code;
+}
+
+/* SkipFunctionBody - skip to the END FUNCTION statement */
+static void SkipFunctionBody(ParseContext *c)
+{
+    while (ParseGetLine(c)) {
+        if (GetToken(c) == T_END_FUNCTION)
+            return;
+    }
+    ParseError(c, "missing END FUNCTION");
+}
+
+/* ReopenFile - reopen an included file and skip to a function definition */
+static void ReopenFile(ParseContext *c, LazyFunction *f)
+{
+    System *sys = c->sys;
+    ParseFile *pf;
+
+    /* open the file */
+    if (!(pf = OpenParseFile(c, f->file)))
+        Abort(sys, "can't reopen '%s'", f->file->name);
+    c->currentFile = pf;
+
+    /* skip to the line before the FUNCTION statement */
+    while (pf->lineNumber < f->lineNumber - 1) {
+        if (!ReadParseFile(sys, pf))
+            Abort(sys, "can't find the definition of '%s'", f->symbol->name);
+    }
+}
+
+/* PlaceRuntimeSymbols - place the strings and variables first referenced by a function compiled at runtime */
+static void PlaceRuntimeSymbols(ParseContext *c)
+{
+    GenerateContext *g = c->g;
+    Symbol *symbol;
+    String *str;
+
+    for (str = c->strings; str != NULL; str = str->next) {
+        if (!str->placed)
+            PlaceString(g, str, StoreByteVector(g, (uint8_t *)str->data, str->length + 1));
+    }
+
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        if (!symbol->placed) {
+            if (symbol->storageClass == SC_FUNCTION)
+                Abort(c->sys, "undefined function: %s", symbol->name);
+            else if (symbol->storageClass == SC_VARIABLE)
+                PlaceSymbol(g, symbol, ReserveSpace(g, sizeof(VMVALUE)));
+        }
+    }
+}
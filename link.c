@@ -0,0 +1,416 @@
+/* link.c - relocatable object modules and linker
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include "compile.h"
+
+/* local function prototypes */
+static Symbol *LinkSymbol(ParseContext *c, ObjectSymbol *osym);
+static DataBlock *FindDataBlock(ParseContext *c, Symbol *symbol);
+static ObjectHdr *NewObject(ParseContext *c, size_t size, VMUVALUE codeBase, VMUVALUE codeSize);
+static uint8_t *StoreObjectString(ObjectHdr *hdr, uint8_t *p, String *str, VMUVALUE chain);
+static uint8_t *StoreObjectSymbol(ObjectHdr *hdr, uint8_t *p, Symbol *symbol, VMUVALUE chain);
+static uint8_t *StoreObjectLine(ObjectHdr *hdr, uint8_t *p, LineEntry *line);
+static size_t ObjectNameLength(ParseContext *c, const char *module, const char *name, const uint8_t *end);
+static void CheckObjectRecords(ParseContext *c, const char *module, const uint8_t *p, const uint8_t *end, VMUVALUE count, size_t size);
+static int WriteModule(ObjectHdr *hdr, const char *name);
+static void LinkModule(ParseContext *c, const char *name, uint8_t *object);
+
+/* IsObjectName - check for the name of an object module */
+int IsObjectName(const char *name)
+{
+    int len = strlen(name);
+    return len >= 4 && strcasecmp(&name[len - 4], ".obj") == 0;
+}
+
+/* BuildObject - build an object module in memory from the code, strings and global symbols of a relocatable compile */
+ObjectHdr *BuildObject(ParseContext *c)
+{
+    GenerateContext *g = c->g;
+    VMUVALUE codeSize = codeaddr(g) - sizeof(ImageHdr);
+    ObjectHdr *hdr;
+    LineEntry *line;
+    DataBlock *data;
+    Symbol *symbol;
+    String *str;
+    size_t size;
+    uint8_t *p;
+
+    /* determine the size of the object module */
+    size = sizeof(ObjectHdr) + ((codeSize + ALIGN_MASK) & ~ALIGN_MASK);
+    for (str = c->strings; str != NULL; str = str->next)
+        size += ObjectStringSize(str->length);
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        size += ObjectSymbolSize(strlen(symbol->name));
+        if ((data = FindDataBlock(c, symbol)) != NULL && data->initializers)
+            size += data->size * sizeof(VMVALUE);
+    }
+    size += g->lineCount * sizeof(ImageLine);
+
+    /* build the object module starting with the code */
+    hdr = NewObject(c, size, sizeof(ImageHdr), codeSize);
+    p = (uint8_t *)hdr + sizeof(ObjectHdr) + ((codeSize + ALIGN_MASK) & ~ALIGN_MASK);
+
+    /* store the strings with their reference chains */
+    for (str = c->strings; str != NULL; str = str->next)
+        p = StoreObjectString(hdr, p, str, str->value);
+
+    /* store the global symbols with their definitions and reference chains */
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        ObjectSymbol *osym = (ObjectSymbol *)p;
+        p = StoreObjectSymbol(hdr, p, symbol, symbol->value);
+        if (symbol->storageClass == SC_FUNCTION) {
+            if (symbol->definition) {
+                osym->flags = OBJECT_DEFINED;
+                osym->value = symbol->definition;
+            }
+        }
+        else if ((data = FindDataBlock(c, symbol)) != NULL) {
+            osym->flags = OBJECT_DEFINED;
+            osym->value = data->size;
+            if (data->initializers) {
+                osym->flags |= OBJECT_INITIALIZED;
+                memcpy(p, data->initializers, data->size * sizeof(VMVALUE));
+                p += data->size * sizeof(VMVALUE);
+            }
+        }
+    }
+
+    /* store the line table */
+    for (line = g->lines; line != NULL; line = line->next)
+        p = StoreObjectLine(hdr, p, line);
+
+    return hdr;
+}
+
+/* WriteObject - write an object module built by BuildObject */
+void WriteObject(ParseContext *c, ObjectHdr *hdr, const char *name)
+{
+    if (!WriteModule(hdr, name))
+        Abort(c->sys, "error writing object module: %s", name);
+}
+
+/* WriteFragment - write a function fragment to an object module that defines the function */
+int WriteFragment(ParseContext *c, const char *name, Symbol *symbol, Fragment *f)
+{
+    VMUVALUE codeSize = codeaddr(c->g) - f->start;
+    int selfReference = VMFALSE;
+    FragmentRef *ref;
+    LineEntry *line;
+    ObjectHdr *hdr;
+    size_t size;
+    uint8_t *p;
+
+    /* determine the size of the object module */
+    size = sizeof(ObjectHdr) + ((codeSize + ALIGN_MASK) & ~ALIGN_MASK);
+    for (ref = f->refs; ref != NULL; ref = ref->next) {
+        if (ref->string)
+            size += ObjectStringSize(ref->string->length);
+        else {
+            size += ObjectSymbolSize(strlen(ref->symbol->name));
+            if (ref->symbol == symbol)
+                selfReference = VMTRUE;
+        }
+    }
+    if (!selfReference)
+        size += ObjectSymbolSize(strlen(symbol->name));
+    size += f->lineCount * sizeof(ImageLine);
+
+    /* build the object module starting with the code */
+    hdr = NewObject(c, size, f->start, codeSize);
+    p = (uint8_t *)hdr + sizeof(ObjectHdr) + ((codeSize + ALIGN_MASK) & ~ALIGN_MASK);
+
+    /* store the strings referenced by the fragment */
+    for (ref = f->refs; ref != NULL; ref = ref->next)
+        if (ref->string)
+            p = StoreObjectString(hdr, p, ref->string, ref->chain);
+
+    /* store the symbols referenced by the fragment */
+    for (ref = f->refs; ref != NULL; ref = ref->next)
+        if (ref->symbol && ref->symbol != symbol)
+            p = StoreObjectSymbol(hdr, p, ref->symbol, ref->chain);
+
+    /* store the definition of the function along with any recursive references */
+    for (ref = f->refs; ref != NULL; ref = ref->next)
+        if (ref->symbol == symbol)
+            break;
+    ((ObjectSymbol *)p)->flags = OBJECT_DEFINED;
+    ((ObjectSymbol *)p)->value = f->start;
+    p = StoreObjectSymbol(hdr, p, symbol, ref ? ref->chain : 0);
+
+    /* store the line table */
+    for (line = f->lines; line != NULL; line = line->next)
+        p = StoreObjectLine(hdr, p, line);
+
+    /* write the object module removing anything partially written */
+    if (!WriteModule(hdr, name)) {
+        VM_remove(name);
+        return VMFALSE;
+    }
+    return VMTRUE;
+}
+
+/* LinkObject - link an object module into the program being compiled */
+void LinkObject(ParseContext *c, const char *name)
+{
+    uint8_t *object;
+    ObjectHdr hdr;
+    VMFILE *fp;
+    Phase phase;
+    int sts;
+
+    /* only link each module once */
+    if (!AddIncludedFile(c, name))
+        return;
+    phase = EnterPhase(c->sys, PHASE_LINK);
+
+    /* read and check the object module header */
+    if (!(fp = VM_fopen(name, "rb")))
+        ParseError(c, "object module not found: %s", name);
+    if (VM_fread(&hdr, 1, sizeof(ObjectHdr), fp) != sizeof(ObjectHdr)
+    ||  hdr.magic != OBJECT_MAGIC
+    ||  hdr.version != OBJECT_VERSION
+    ||  hdr.wordSize != sizeof(VMVALUE)
+    ||  hdr.objectSize < sizeof(ObjectHdr)
+    ||  hdr.codeSize > hdr.objectSize - sizeof(ObjectHdr)) {
+        VM_fclose(fp);
+        ParseError(c, "invalid object module: %s", name);
+    }
+
+    /* read the rest of the object module */
+    object = (uint8_t *)AllocateHighMemory(c->sys, hdr.objectSize, HEAP_CODE);
+    memcpy(object, &hdr, sizeof(ObjectHdr));
+    sts = VM_fread(object + sizeof(ObjectHdr), 1, hdr.objectSize - sizeof(ObjectHdr), fp) == hdr.objectSize - sizeof(ObjectHdr);
+    VM_fclose(fp);
+    if (!sts)
+        ParseError(c, "error reading object module: %s", name);
+
+    LinkModule(c, name, object);
+    EnterPhase(c->sys, phase);
+}
+
+/* LinkObjectModule - link an object module already in memory into the program being compiled */
+/* (the name is the file it was compiled from, which then counts as included) */
+void LinkObjectModule(ParseContext *c, const char *name, uint8_t *object)
+{
+    Phase phase;
+
+    /* only link each module once */
+    if (!AddIncludedFile(c, name))
+        return;
+    phase = EnterPhase(c->sys, PHASE_LINK);
+
+    LinkModule(c, name, object);
+    EnterPhase(c->sys, phase);
+}
+
+/* LinkModule - link the code, strings, symbols and line table of an object module with a valid header */
+/* (the object module isn't changed so one in memory can be linked any number of times) */
+static void LinkModule(ParseContext *c, const char *name, uint8_t *object)
+{
+    GenerateContext *g = c->g;
+    ObjectHdr *hdr = (ObjectHdr *)object;
+    uint8_t *end = object + hdr->objectSize, *p;
+    VMVALUE delta;
+    VMUVALUE i;
+
+    /* append the code and find how far it moved */
+    p = object + sizeof(ObjectHdr);
+    delta = StoreCode(g, p, hdr->codeSize) - hdr->codeBase;
+    p += (hdr->codeSize + ALIGN_MASK) & ~ALIGN_MASK;
+
+    /* add the strings to the string table */
+    for (i = 0; i < hdr->stringCount; ++i) {
+        ObjectString *ostr = (ObjectString *)p;
+        size_t length = ObjectNameLength(c, name, ostr->data, end);
+        LinkStringRefs(g, AddString(c, ostr->data), ostr->chain, delta);
+        p += ObjectStringSize(length);
+    }
+
+    /* add the symbols to the global symbol table */
+    for (i = 0; i < hdr->symbolCount; ++i) {
+        ObjectSymbol *osym = (ObjectSymbol *)p;
+        size_t length = ObjectNameLength(c, name, osym->name, end);
+        Symbol *symbol = LinkSymbol(c, osym);
+        p += ObjectSymbolSize(length);
+        if (osym->flags & OBJECT_DEFINED) {
+            if (osym->kind == EXPORT_FUNCTION) {
+                if (osym->value - hdr->codeBase >= hdr->codeSize)
+                    ParseError(c, "invalid object module: %s", name);
+                DefineFunction(g, symbol, osym->value + delta);
+            }
+            else {
+                DataBlock *data;
+                if (FindDataBlock(c, symbol))
+                    ParseError(c, "duplicate definition of '%s'", osym->name);
+                if (osym->flags & OBJECT_INITIALIZED)
+                    CheckObjectRecords(c, name, p, end, osym->value, sizeof(VMVALUE));
+                data = AddDataBlock(c, symbol, osym->value, osym->flags & OBJECT_INITIALIZED);
+                if (data->initializers) {
+                    memcpy(data->initializers, p, data->size * sizeof(VMVALUE));
+                    p += data->size * sizeof(VMVALUE);
+                }
+            }
+        }
+        LinkSymbolRefs(g, symbol, osym->chain, delta);
+    }
+
+    /* add the line table entries */
+    CheckObjectRecords(c, name, p, end, hdr->lineCount, sizeof(ImageLine));
+    LinkLines(g, (ImageLine *)p, hdr->lineCount, delta);
+}
+
+/* ObjectNameLength - get the length of the name in a string or symbol record that must end within the object module */
+static size_t ObjectNameLength(ParseContext *c, const char *module, const char *name, const uint8_t *end)
+{
+    const char *nul;
+    if ((const uint8_t *)name >= end || !(nul = memchr(name, '\0', end - (const uint8_t *)name)))
+        ParseError(c, "invalid object module: %s", module);
+    return nul - name;
+}
+
+/* CheckObjectRecords - check that a number of records of a size are within the object module */
+static void CheckObjectRecords(ParseContext *c, const char *module, const uint8_t *p, const uint8_t *end, VMUVALUE count, size_t size)
+{
+    if (p > end || count > (size_t)(end - p) / size)
+        ParseError(c, "invalid object module: %s", module);
+}
+
+/* NewObject - allocate an object module and copy the code into it */
+static ObjectHdr *NewObject(ParseContext *c, size_t size, VMUVALUE codeBase, VMUVALUE codeSize)
+{
+    ObjectHdr *hdr;
+
+    /* allocate space to build the object module */
+    hdr = (ObjectHdr *)AllocateHighMemory(c->sys, size, HEAP_CODE);
+    memset(hdr, 0, size);
+
+    /* fill in the header */
+    hdr->magic = OBJECT_MAGIC;
+    hdr->version = OBJECT_VERSION;
+    hdr->wordSize = sizeof(VMVALUE);
+    hdr->codeBase = codeBase;
+    hdr->codeSize = codeSize;
+    hdr->stringCount = 0;
+    hdr->symbolCount = 0;
+    hdr->lineCount = 0;
+    hdr->objectSize = size;
+
+    /* copy the code */
+    memcpy((uint8_t *)hdr + sizeof(ObjectHdr), c->g->codeBuf + codeBase, codeSize);
+
+    return hdr;
+}
+
+/* StoreObjectString - store a string record */
+static uint8_t *StoreObjectString(ObjectHdr *hdr, uint8_t *p, String *str, VMUVALUE chain)
+{
+    ObjectString *ostr = (ObjectString *)p;
+    ostr->chain = chain;
+    memcpy(ostr->data, str->data, str->length + 1);
+    ++hdr->stringCount;
+    return p + ObjectStringSize(str->length);
+}
+
+/* StoreObjectSymbol - store a symbol record (the caller fills in any definition) */
+static uint8_t *StoreObjectSymbol(ObjectHdr *hdr, uint8_t *p, Symbol *symbol, VMUVALUE chain)
+{
+    ObjectSymbol *osym = (ObjectSymbol *)p;
+    osym->chain = chain;
+    osym->kind = ExportKind(symbol);
+    strcpy(osym->name, symbol->name);
+    ++hdr->symbolCount;
+    return p + ObjectSymbolSize(strlen(symbol->name));
+}
+
+/* StoreObjectLine - store a line record */
+static uint8_t *StoreObjectLine(ObjectHdr *hdr, uint8_t *p, LineEntry *line)
+{
+    ImageLine *oline = (ImageLine *)p;
+    oline->offset = line->offset;
+    oline->lineNumber = line->lineNumber;
+    ++hdr->lineCount;
+    return p + sizeof(ImageLine);
+}
+
+/* WriteModule - write an object module to a file */
+static int WriteModule(ObjectHdr *hdr, const char *name)
+{
+    VMFILE *fp;
+    int sts;
+    if (!(fp = VM_fopen(name, "wb")))
+        return VMFALSE;
+    sts = VM_fwrite(hdr, 1, hdr->objectSize, fp) == hdr->objectSize;
+    VM_fclose(fp);
+    return sts;
+}
+
+/* LinkSymbol - find or add the global symbol for an object module symbol */
+static Symbol *LinkSymbol(ParseContext *c, ObjectSymbol *osym)
+{
+    StorageClass storageClass;
+    Symbol *symbol;
+    Type *type;
+
+    /* get the storage class and type of the symbol */
+    switch (osym->kind) {
+    case EXPORT_FUNCTION:
+        storageClass = SC_FUNCTION;
+        type = &c->integerFunctionType;
+        break;
+    case EXPORT_VARIABLE:
+        storageClass = SC_VARIABLE;
+        type = &c->integerType;
+        break;
+    case EXPORT_ARRAY:
+        storageClass = SC_CONSTANT;
+        type = &c->integerType;
+        break;
+    default:
+        storageClass = SC_UNKNOWN;
+        type = &c->unknownType;
+        break;
+    }
+
+    /* add the symbol if it isn't already in the symbol table */
+    if (!(symbol = FindGlobal(c, osym->name, HashName(osym->name))))
+        return AddGlobal(c, osym->name, storageClass, type, 0);
+
+    /* resolve or check the existing symbol */
+    if (symbol->storageClass == SC_UNKNOWN) {
+        symbol->storageClass = storageClass;
+        symbol->type = type;
+    }
+    else if (storageClass != SC_UNKNOWN && symbol->storageClass != storageClass)
+        ParseError(c, "conflicting definitions of '%s'", osym->name);
+
+    return symbol;
+}
+
+/* FindDataBlock - find the data block for a global symbol */
+static DataBlock *FindDataBlock(ParseContext *c, Symbol *symbol)
+{
+    DataBlock *data;
+    for (data = c->dataBlocks; data != NULL; data = data->next)
+        if (data->symbol == symbol)
+            return data;
+    return NULL;
+}
+
+/* ExportKind - get the export kind of a global symbol (zero if it is unresolved) */
+int ExportKind(Symbol *symbol)
+{
+    switch (symbol->storageClass) {
+    case SC_FUNCTION:
+        return EXPORT_FUNCTION;
+    case SC_VARIABLE:
+        return EXPORT_VARIABLE;
+    case SC_CONSTANT:
+        return EXPORT_ARRAY;
+    default:
+        return 0;
+    }
+}
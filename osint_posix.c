@@ -3,11 +3,20 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include "edit.h"
+#include "driver.h"
+#include "server.h"
 #include "compile.h"
 #include "system.h"
 
 #ifdef PROPELLER
 #include <sys/vfs.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #endif
 
 /*
@@ -21,14 +30,20 @@ grows upwards towards the end of memory. You can access the stack pointer by the
 that is "free" (as long as you don't need a deeper stack, of course).
 */
 
+/* the command line program is left out of the library */
+#ifndef EMBEDDED
+
 #ifdef PROPELLER
 #define STACK_SIZE      (32 * 1024)
-#else
-#define WORKSPACE_SIZE  (64 * 1024)
-uint8_t workspace[WORKSPACE_SIZE];
 #endif
 
 static char *GetConsoleLine(char *buf, int size, int *pLineNumber, void *cookie);
+#ifndef PROPELLER
+static uint8_t *ReserveWorkspace(size_t size);
+static int ParseSize(const char *str, size_t *pSize);
+static int BuildFiles(System *sys, char **files, int count, const char *outputName, int jobs);
+static void Usage(void);
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -37,12 +52,102 @@ int main(int argc, char *argv[])
     size_t workspaceSize = (64 * 1024);
     System *sys = InitSystem(workspace, workspaceSize);
 #else
-    System *sys = InitSystem(workspace, sizeof(workspace));
+    size_t workspaceSize = WORKSPACESIZE;
+    size_t imageBufferSize = 0;
+    int diagnostics = -1, compileOnly = VMFALSE, jobs = 1;
+    const char *outputName = NULL, *serverPath = NULL, *clientPath = NULL;
+    uint8_t *workspace;
+    char **files;
+    System *sys;
+    int fileCount, i;
+    
+    /* get the options and the files (which can be mixed with them) */
+    files = &argv[1];
+    fileCount = 0;
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-')
+            files[fileCount++] = argv[i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            if (!ParseSize(argv[++i], &workspaceSize))
+                Usage();
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            if (!ParseSize(argv[++i], &imageBufferSize))
+                Usage();
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            if ((diagnostics = atoi(argv[++i])) < DIAG_QUIET || diagnostics > DIAG_DUMP)
+                Usage();
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+            compileOnly = VMTRUE;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outputName = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            if ((jobs = atoi(argv[++i])) < 1)
+                Usage();
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            serverPath = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            clientPath = argv[++i];
+        else
+            Usage();
+    }
+    
+    /* -c needs files to compile and -o can only name the output of one */
+    if ((compileOnly && fileCount == 0) || (outputName && (!compileOnly || fileCount != 1)))
+        Usage();
+    
+    /* only one program can be run or sent to a server (and it gets no arguments) */
+    if (!compileOnly && !serverPath && fileCount > 1)
+        Usage();
+    
+    /* a server runs the files its clients send (any files named are include files it compiles first) */
+    /* and a client doesn't need a workspace of its own */
+    if (serverPath && (compileOnly || clientPath))
+        Usage();
+    else if (clientPath) {
+        if (compileOnly)
+            Usage();
+        return SubmitJob(clientPath, fileCount > 0 ? files[0] : "-");
+    }
+    
+    /* only show diagnostics from the command line driver if they are asked for */
+    if (diagnostics < 0)
+        diagnostics = fileCount > 0 || serverPath ? DIAG_QUIET : DIAG_DUMP;
+    
+    /* leave most of the workspace for the compiler heap and the edit buffer */
+    if (imageBufferSize == 0)
+        imageBufferSize = workspaceSize / 4 < HOSTIMAGESIZE ? workspaceSize / 4 : HOSTIMAGESIZE;
+    else if (imageBufferSize > workspaceSize / 2) {
+        fprintf(stderr, "error: the image buffer can be at most half of the workspace\n");
+        return 1;
+    }
+    
+    /* the workspace only uses memory for the pages that are touched */
+    if (!(workspace = ReserveWorkspace(workspaceSize))) {
+        fprintf(stderr, "error: can't reserve a %lu byte workspace\n", (unsigned long)workspaceSize);
+        return 1;
+    }
+    if ((sys = InitSystem(workspace, workspaceSize)) != NULL) {
+        sys->imageBufferSize = imageBufferSize;
+        sys->diagnostics = (DiagnosticsLevel)diagnostics;
+    }
 #endif
     if (sys) {
 #ifdef PROPELLER
     _setrootvfs(_vfs_open_host());  // to access host files
     //_setrootvfs(_vfs_open_sdcard()); // to access files on SD card
+#endif
+#ifndef PROPELLER
+        /* compile or run files named on the command line */
+        if (serverPath)
+            return RunServer(sys, serverPath, files, fileCount) ? 0 : 1;
+        else if (compileOnly)
+            return BuildFiles(sys, files, fileCount, outputName, jobs) ? 0 : 1;
+        else if (fileCount > 0)
+            return RunFile(sys, files[0]) ? 0 : 1;
 #endif
         sys->getLine = GetConsoleLine;
         EditWorkspace(sys);
@@ -50,6 +155,118 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+#ifndef PROPELLER
+
+/* ReserveWorkspace - reserve address space for the workspace without committing memory */
+static uint8_t *ReserveWorkspace(size_t size)
+{
+    void *workspace;
+    workspace = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    return workspace == MAP_FAILED ? NULL : (uint8_t *)workspace;
+}
+
+/* ParseSize - parse a size with an optional K or M suffix */
+static int ParseSize(const char *str, size_t *pSize)
+{
+    unsigned long size;
+    char *end;
+    
+    size = strtoul(str, &end, 10);
+    switch (toupper(*end)) {
+    case 'K':
+        size *= 1024;
+        ++end;
+        break;
+    case 'M':
+        size *= 1024 * 1024;
+        ++end;
+        break;
+    }
+    if (end == str || *end != '\0' || size == 0)
+        return VMFALSE;
+    
+    *pSize = (size_t)size;
+    return VMTRUE;
+}
+
+/* BuildFiles - compile source files running up to a number of compiles at once */
+/* (each parallel compile runs in a child process with its own copy of the workspace) */
+static int BuildFiles(System *sys, char **files, int count, const char *outputName, int jobs)
+{
+    int running = 0, failed = 0, status, i;
+    pid_t pid;
+    
+    for (i = 0; i < count; ++i) {
+        
+        /* wait for a compile to finish if enough are running */
+        if (running == jobs) {
+            if (wait(&status) > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+                ++failed;
+            --running;
+        }
+        
+        /* compile one at a time in this process */
+        if (jobs == 1 || count == 1) {
+            if (!BuildFile(sys, files[i], outputName))
+                ++failed;
+        }
+        
+        /* or start a child process to do the compile */
+        else {
+            VM_flush();
+            if ((pid = fork()) == 0)
+                _exit(BuildFile(sys, files[i], NULL) ? 0 : 1);
+            else if (pid > 0)
+                ++running;
+            else {
+                fprintf(stderr, "error: can't start a compile of '%s'\n", files[i]);
+                ++failed;
+            }
+        }
+    }
+    
+    /* wait for the rest of the compiles to finish */
+    for (; running > 0; --running) {
+        if (wait(&status) > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+            ++failed;
+    }
+    
+    return failed == 0;
+}
+
+/* Usage - display the command line options and exit */
+static void Usage(void)
+{
+    fprintf(stderr, "\
+usage: junkbasic [ options ]                        edit programs interactively\n\
+       junkbasic [ options ] file.bas              compile and run a program\n\
+       junkbasic [ options ] -c file.bas...        compile programs to images\n\
+       junkbasic [ options ] -s socket [ file.bas... ]  run programs sent by clients\n\
+       junkbasic -S socket [ file ]                have a server run a program\n\
+\n\
+options:\n\
+    -m size     size of the workspace (default is %dM)\n\
+    -i size     size of the image buffer (default is %dK or a quarter of the workspace)\n\
+    -d level    diagnostics: 0 quiet, 1 phase times, 2 also dumps and heap usage\n\
+                (the default is 0 for files on the command line and 2 when editing)\n\
+    -c          compile each file to an image with the same name ending in .img\n\
+    -o file     name of the image or, if it ends in .obj, object module for one file\n\
+    -j jobs     number of files to compile at once (default is 1)\n\
+    -s socket   run the programs clients send to a Unix domain socket\n\
+                (include files named after it are compiled once for every program)\n\
+    -S socket   send a source or image file (or the source on stdin) to a server\n\
+\n\
+Sizes can end with K or M. Workspace memory is only used as it is needed.\n\
+A program can start with a #! line so it can be run as a script.\n\
+An image file (ending in .img) is run without compiling anything.\n\
+", WORKSPACESIZE / (1024 * 1024), HOSTIMAGESIZE / 1024);
+    exit(1);
+}
+
+#endif
+
+#endif
+
 void VM_flush(void)
 {
     fflush(stdout);
@@ -74,6 +291,18 @@ void VM_putchar(int ch)
     putchar(ch);
 }
 
+/* VM_ticks - get a free running microsecond count for timing */
+uint32_t VM_ticks(void)
+{
+#ifdef PROPELLER
+    return _getus();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000 + (uint32_t)(ts.tv_nsec / 1000);
+#endif
+}
+
 void *VM_open(System *sys, const char *name, const char *mode)
 {
     return (void *)fopen(name, mode);
@@ -89,6 +318,152 @@ void VM_close(void *fp)
     fclose((FILE *)fp);
 }
 
+#ifdef PROPELLER
+
+/* VM_mapimage - read an image file into low memory followed by its cleared bss */
+uint8_t *VM_mapimage(System *sys, const char *name, size_t imageSize, size_t totalSize)
+{
+    uint8_t *image;
+    FILE *fp;
+    
+    if (!(fp = fopen(name, "rb")))
+        return NULL;
+        
+    if (!(image = (uint8_t *)AllocateLowMemory(sys, totalSize, HEAP_CODE))
+    ||  fread(image, 1, imageSize, fp) != imageSize) {
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    
+    memset(image + imageSize, 0, totalSize - imageSize);
+    
+    return image;
+}
+
+/* VM_unmapimage - release an image read by VM_mapimage */
+void VM_unmapimage(uint8_t *image, size_t totalSize)
+{
+    /* the image is released along with the rest of low memory */
+}
+
+/* VM_mapsource - source files are read a line at a time */
+char *VM_mapsource(const char *name, size_t *pSize)
+{
+    return NULL;
+}
+
+/* VM_unmapsource - release a source file mapped by VM_mapsource */
+void VM_unmapsource(char *text, size_t size)
+{
+}
+
+int VM_mkdir(const char *name)
+{
+    return -1;
+}
+
+#else
+
+/* VM_mapimage - map an image file into memory followed by its cleared bss */
+uint8_t *VM_mapimage(System *sys, const char *name, size_t imageSize, size_t totalSize)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    struct stat st;
+    size_t tail;
+    void *image;
+    int fd;
+    
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return NULL;
+        
+    /* pages of the mapping past the end of the file can't be touched */
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < imageSize) {
+        close(fd);
+        return NULL;
+    }
+        
+    /* reserve zero-filled memory for the image and its bss */
+    if ((image = mmap(NULL, totalSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    
+    /* map the image file over the start of it (pages are only read as they are touched) */
+    if (mmap(image, imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(image, totalSize);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    
+    /* clear the part of the bss that shares the last page of the file */
+    tail = pageSize - (imageSize % pageSize);
+    if (tail != pageSize)
+        memset((uint8_t *)image + imageSize, 0, tail < totalSize - imageSize ? tail : totalSize - imageSize);
+    
+    return (uint8_t *)image;
+}
+
+/* VM_unmapimage - unmap an image mapped by VM_mapimage */
+void VM_unmapimage(uint8_t *image, size_t totalSize)
+{
+    munmap(image, totalSize);
+}
+
+/* VM_mapsource - map a source file followed by two zero bytes that can be written */
+/* (the scanner terminates each line in place so the mapping is private) */
+/* (only a regular file can be mapped so a pipe or device is left to be read a line at a time) */
+char *VM_mapsource(const char *name, size_t *pSize)
+{
+    struct stat st;
+    void *text;
+    int fd;
+    
+    /* check the type before opening so a FIFO isn't opened twice */
+    if (stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    
+    /* reserve zero-filled memory for the text and the bytes after it */
+    if ((text = mmap(NULL, st.st_size + 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    
+    /* map the file over the start of it */
+    if (st.st_size > 0 && mmap(text, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(text, st.st_size + 2);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    
+    /* make sure the bytes after the text are zero */
+    memset((char *)text + st.st_size, 0, 2);
+    
+    *pSize = st.st_size;
+    return (char *)text;
+}
+
+/* VM_unmapsource - unmap a source file mapped by VM_mapsource */
+void VM_unmapsource(char *text, size_t size)
+{
+    munmap(text, size + 2);
+}
+
+int VM_mkdir(const char *name)
+{
+    return mkdir(name, 0777);
+}
+
+#endif
+
 int VM_opendir(const char *path, VMDIR *dir)
 {
     if (!(dir->dirp = opendir(path)))
@@ -113,6 +488,7 @@ void VM_closedir(VMDIR *dir)
     closedir(dir->dirp);
 }
 
+#ifndef EMBEDDED
 #ifdef LINE_EDIT
 static char *GetConsoleLine(char *buf, int size, int *pLineNumber, void *cookie)
 {
@@ -149,3 +525,4 @@ static char *GetConsoleLine(char *buf, int size, int *pLineNumber, void *cookie)
     return fgets(buf, size, stdin);
 }
 #endif
+#endif
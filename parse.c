@@ -34,20 +34,63 @@ static char *nodeTypeNames[] = {
     "NodeTypeConjunction"
 };
 
+/* binary operator precedence levels (all of the binary operators are left associative) */
+enum {
+    PREC_OR = 1,    /* OR */
+    PREC_AND,       /* AND */
+    PREC_BXOR,      /* ^ */
+    PREC_BOR,       /* | */
+    PREC_BAND,      /* & */
+    PREC_EQUALITY,  /* = <> */
+    PREC_RELATION,  /* < <= >= > */
+    PREC_SHIFT,     /* << >> */
+    PREC_ADD,       /* + - */
+    PREC_MUL        /* * / MOD */
+};
+
+/* binary operator table */
+static struct {
+    int token;
+    int precedence;
+    int op;         /* opcode for the operator (OR and AND build short circuit lists instead) */
+    int fold;       /* TRUE if the operator is evaluated at compile time on constant operands */
+} btab[] = {
+{   '+',        PREC_ADD,       OP_ADD,     VMTRUE  },
+{   '-',        PREC_ADD,       OP_SUB,     VMTRUE  },
+{   '*',        PREC_MUL,       OP_MUL,     VMTRUE  },
+{   '/',        PREC_MUL,       OP_DIV,     VMTRUE  },
+{   T_MOD,      PREC_MUL,       OP_REM,     VMTRUE  },
+{   '=',        PREC_EQUALITY,  OP_EQ,      VMFALSE },
+{   T_NE,       PREC_EQUALITY,  OP_NE,      VMFALSE },
+{   '<',        PREC_RELATION,  OP_LT,      VMFALSE },
+{   T_LE,       PREC_RELATION,  OP_LE,      VMFALSE },
+{   T_GE,       PREC_RELATION,  OP_GE,      VMFALSE },
+{   '>',        PREC_RELATION,  OP_GT,      VMFALSE },
+{   T_AND,      PREC_AND,       0,          VMFALSE },
+{   T_OR,       PREC_OR,        0,          VMFALSE },
+{   T_SHL,      PREC_SHIFT,     OP_SHL,     VMTRUE  },
+{   T_SHR,      PREC_SHIFT,     OP_SHR,     VMTRUE  },
+{   '&',        PREC_BAND,      OP_BAND,    VMTRUE  },
+{   '|',        PREC_BOR,       OP_BOR,     VMTRUE  },
+{   '^',        PREC_BXOR,      OP_BXOR,    VMTRUE  },
+{   0,          0,              0,          VMFALSE }
+};
+
+/* btab index plus one for each token (zero if it isn't a binary operator) */
+static uint8_t btabIndex[T_EOF + 1];
+
 /* local function prototypes */
 static void ParseInclude(ParseContext *c);
-static String *AddString(ParseContext *c, const char *value);
 static ParseTreeNode *ParseExpr(ParseContext *c);
 static ParseTreeNode *ParsePrimary(ParseContext *c);
-static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name);
+static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name, SymbolHash hash);
 static void ParseFunction(ParseContext *c);
 static void ParseEndFunction(ParseContext *c);
 static void EndFunction(ParseContext *c);
 static void ParseDim(ParseContext *c);
 static int ParseVariableDecl(ParseContext *c, char *name, VMVALUE *pSize);
 static VMVALUE ParseScalarInitializer(ParseContext *c);
-static void ParseArrayInitializers(ParseContext *c, VMVALUE size);
-static void ClearArrayInitializers(ParseContext *c, VMVALUE size);
+static void ParseArrayInitializers(ParseContext *c, DataBlock *data);
 static void ParseImpliedLetOrFunctionCall(ParseContext *c);
 static void ParseLet(ParseContext *c);
 static void ParseIf(ParseContext *c);
@@ -65,20 +108,14 @@ static void ParseLoopUntil(ParseContext *c);
 static void ParseReturn(ParseContext *c);
 static void ParsePrint(ParseContext *c);
 static void ParseEnd(ParseContext *c);
-static ParseTreeNode *ParseExpr2(ParseContext *c);
-static ParseTreeNode *ParseExpr3(ParseContext *c);
-static ParseTreeNode *ParseExpr4(ParseContext *c);
-static ParseTreeNode *ParseExpr5(ParseContext *c);
-static ParseTreeNode *ParseExpr6(ParseContext *c);
-static ParseTreeNode *ParseExpr7(ParseContext *c);
-static ParseTreeNode *ParseExpr8(ParseContext *c);
-static ParseTreeNode *ParseExpr9(ParseContext *c);
-static ParseTreeNode *ParseExpr10(ParseContext *c);
-static ParseTreeNode *ParseExpr11(ParseContext *c);
+static ParseTreeNode *ParseBinaryExpr(ParseContext *c, int precedence);
+static int FindBinaryOp(int tkn);
+static VMVALUE FoldBinaryOp(ParseContext *c, int op, VMVALUE left, VMVALUE right);
+static ParseTreeNode *ParseUnaryExpr(ParseContext *c);
 static ParseTreeNode *ParseSimplePrimary(ParseContext *c);
 static ParseTreeNode *ParseArrayReference(ParseContext *c, ParseTreeNode *arrayNode);
 static ParseTreeNode *ParseCall(ParseContext *c, ParseTreeNode *functionNode);
-static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name);
+static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name, SymbolHash hash);
 static int IsUnknownGlobolRef(ParseContext *c, ParseTreeNode *node);
 static void ResolveVariableRef(ParseContext *c, ParseTreeNode *node);
 static void ResolveFunctionRef(ParseContext *c, ParseTreeNode *node);
@@ -88,11 +125,15 @@ static char *NodeTypeName(NodeType type);
 static void PushBlock(ParseContext *c, BlockType type, ParseTreeNode *node);
 static void PopBlock(ParseContext *c);
 static int IsIntegerLit(ParseTreeNode *node);
+static int AtTopLevel(ParseContext *c);
+static size_t NodeSize(int type);
+static NodeChunk *FindNodeChunk(ParseContext *c, int index);
 
 /* InitParseContext - parse a statement */
 ParseContext *InitParseContext(System *sys)
 {
-    ParseContext *c = (ParseContext *)AllocateHighMemory(sys, sizeof(ParseContext));
+    ParseContext *c = (ParseContext *)AllocateHighMemory(sys, sizeof(ParseContext), HEAP_COMPILER);
+    int i;
     if (c) {
         memset(c, 0, sizeof(ParseContext));
         c->sys = sys;
@@ -102,6 +143,8 @@ ParseContext *InitParseContext(System *sys)
         c->integerFunctionType.id = TYPE_FUNCTION;
         c->integerFunctionType.u.functionInfo.returnType = &c->integerType;
     }
+    for (i = 0; btab[i].token != 0; ++i)
+        btabIndex[btab[i].token] = i + 1;
     return c;
 }
 
@@ -187,11 +230,27 @@ void ParseStatement(ParseContext *c, int tkn)
 static void ParseInclude(ParseContext *c)
 {
     char name[MAXTOKEN];
+    uint8_t *object;
+    if (!AtTopLevel(c))
+        ParseError(c, "INCLUDE not allowed in a block or function definition");
     FRequire(c, T_STRING);
     strcpy(name, c->token);
     FRequire(c, T_EOL);
-    if (!PushFile(c, name))
+    if (IsObjectName(name)) {
+        SuspendMain(c->g);
+        LinkObject(c, name);
+    }
+    
+    /* link the object module if the file was compiled ahead of time (by a server) */
+    else if (c->sys->findObject && (object = (*c->sys->findObject)(c->sys->findObjectCookie, name)) != NULL) {
+        SuspendMain(c->g);
+        LinkObjectModule(c, name, object);
+    }
+    else if (!PushFile(c, name))
         ParseError(c, "include file not found: %s", name);
+        
+    /* keep the included file information when parse trees are released */
+    MarkHeap(c->sys, &c->treeMark);
 }
 
 /* ParseFunction - parse the 'FUNCTION' statement */
@@ -206,14 +265,25 @@ static void ParseFunction(ParseContext *c)
     else if (c->bptr->type != BLOCK_FUNCTION)
         ParseError(c, "function definition not allowed in another block");
         
+    /* branch around the function from the main code */
+    SuspendMain(c->g);
+        
+#ifdef COMPILE_CACHE
+    /* use the cached code for the function if its source and context haven't changed */
+    if (LinkCachedFunction(c)) {
+        MarkHeap(c->sys, &c->treeMark);
+        return;
+    }
+#endif
+
     /* get the function name */
     FRequire(c, T_IDENTIFIER);
 
     /* enter the function name in the global symbol table */
-    if (!(symbol = FindGlobal(c, c->token)))
+    if (!(symbol = FindGlobal(c, c->token, c->tokenHash)))
         symbol = AddGlobal(c, c->token, SC_FUNCTION, &c->integerFunctionType, 0);
-    else {
-        if (symbol->storageClass != SC_FUNCTION || symbol->type != &c->integerFunctionType || symbol->placed)
+    else if (!c->compilingFunction || symbol != c->compilingFunction->symbol) {
+        if (symbol->storageClass != SC_FUNCTION || symbol->type != &c->integerFunctionType || symbol->placed || symbol->definition)
             ParseError(c, "invalid definition of a forward referenced function");
     }
     
@@ -236,6 +306,14 @@ static void ParseFunction(ParseContext *c)
         SaveToken(c, tkn);
 
     FRequire(c, T_EOL);
+    
+    /* only generate a stub if the body is to be compiled when the function is first called */
+    if (c->lazy && !c->compilingFunction) {
+        EndFunction(c);
+        ReleaseHighMemory(c->sys, &c->treeMark);
+        AddLazyFunction(c, symbol);
+        MarkHeap(c->sys, &c->treeMark);
+    }
 }
 
 /* ParseEndFunction - parse the 'END FUNCTION' statement */
@@ -245,9 +323,55 @@ static void ParseEndFunction(ParseContext *c)
         ParseError(c, "not in a function definition");
     else if (c->bptr->type != BLOCK_FUNCTION)
         ParseError(c, "function definition not complete");
+    EndStatementList(c);
     //PrintNode(c->currentFunction, 0);
     Generate(c->g, c->currentFunction);
+#ifdef COMPILE_CACHE
+    CacheFunction(c);
+#endif
     EndFunction(c);
+    
+    /* the parse tree and local symbols of the function are no longer needed */
+    /* (a function compiled for a running program is released by CompileLazyFunction) */
+    if (!c->compilingFunction)
+        ReleaseHighMemory(c->sys, &c->treeMark);
+}
+
+/* FlushMain - generate code for the main statements parsed so far and release their parse trees */
+void FlushMain(ParseContext *c)
+{
+    ParseTreeNode *node = c->mainFunction;
+    
+    /* object modules can't have main code so it is kept to be checked when the module is complete */
+    if (c->g->relocatable || !AtTopLevel(c))
+        return;
+        
+    /* implicit variables may only be assigned later in the program */
+    EndStatementList(c);
+    if (node->u.functionDefinition.bodyStatements) {
+        ResolveImplicitGlobals(c);
+        GenerateMain(c->g, node);
+        node->u.functionDefinition.bodyStatements = NULL;
+    }
+    ReleaseHighMemory(c->sys, &c->treeMark);
+}
+
+/* ResolveImplicitGlobals - make the unresolved global symbols variables */
+void ResolveImplicitGlobals(ParseContext *c)
+{
+    Symbol *symbol;
+    for (symbol = c->globals.head; symbol != NULL; symbol = symbol->next) {
+        if (symbol->storageClass == SC_UNKNOWN) {
+            symbol->storageClass = SC_VARIABLE;
+            symbol->type = &c->integerType;
+        }
+    }
+}
+
+/* AtTopLevel - check for being in the main function outside of any block */
+static int AtTopLevel(ParseContext *c)
+{
+    return c->currentFunction == c->mainFunction && c->bptr == &c->blockBuf[0];
 }
 
 /* StartFunction - start a function definition */
@@ -255,18 +379,19 @@ ParseTreeNode *StartFunction(ParseContext *c, Symbol *symbol)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeFunctionDefinition);
     node->u.functionDefinition.symbol = symbol;
-    InitSymbolTable(&node->u.functionDefinition.arguments);
-    InitSymbolTable(&node->u.functionDefinition.locals);
+    InitSymbolTable(c, &node->u.functionDefinition.arguments, LOCALBUCKETS);
+    InitSymbolTable(c, &node->u.functionDefinition.locals, LOCALBUCKETS);
     PushBlock(c, BLOCK_FUNCTION, node);
-    c->bptr->pNextStatement = &node->u.functionDefinition.bodyStatements;
+    c->bptr->pStatements = &node->u.functionDefinition.bodyStatements;
     c->currentFunction = node;
     return node;
 }
 
 /* EndFunction - end a function definition */
+/* (the body is ended by ParseEndFunction before the code for the function is generated) */
 static void EndFunction(ParseContext *c)
 {
-    PopBlock(c);
+    --c->bptr;
     c->currentFunction = c->mainFunction;
 }
 
@@ -274,7 +399,7 @@ static void EndFunction(ParseContext *c)
 static void ParseDim(ParseContext *c)
 {
     char name[MAXTOKEN];
-    VMVALUE value = 0, size = 0;
+    VMVALUE size = 0;
     int isArray;
     int tkn;
 
@@ -286,28 +411,26 @@ static void ParseDim(ParseContext *c)
 
         /* add to the global symbol table if outside a function definition */
         if (c->currentFunction == c->mainFunction) {
+            DataBlock *data;
             Symbol *sym;
 
-            /* get the address of the data */
-            value = codeaddr(c->g);
+            /* add the symbol to the global symbol table (it is placed when the image is built) */
+            sym = AddGlobal(c, name, isArray ? SC_CONSTANT : SC_VARIABLE, &c->integerType, 0);
             
             /* check for initializers */
             if ((tkn = GetToken(c)) == '=') {
+                data = AddDataBlock(c, sym, size, VMTRUE);
                 if (isArray)
-                    ParseArrayInitializers(c, size);
+                    ParseArrayInitializers(c, data);
                 else
-                    putdword(c->g, ParseScalarInitializer(c));
+                    data->initializers[0] = ParseScalarInitializer(c);
             }
 
-            /* no initializers */
+            /* no initializers so the data goes in the bss */
             else {
-                ClearArrayInitializers(c, isArray ? size : 1);
+                AddDataBlock(c, sym, size, VMFALSE);
                 SaveToken(c, tkn);
             }
-
-            /* add the symbol to the global symbol table */
-            sym = AddGlobal(c, name, isArray ? SC_CONSTANT : SC_VARIABLE, &c->integerType, value);
-            sym->placed = VMTRUE;
         }
 
         /* otherwise, add to the local symbol table */
@@ -328,9 +451,9 @@ static void ParseDim(ParseContext *c)
                 
                 /* add code to set the initial value of the variable */
                 node = NewParseTreeNode(c, NodeTypeLetStatement);
-                node->u.letStatement.lvalue = GetSymbolRef(c, name);
+                node->u.letStatement.lvalue = GetSymbolRef(c, name, HashName(name));
                 node->u.letStatement.rvalue = expr;
-                AddNodeToList(c, &c->bptr->pNextStatement, node);
+                AddNodeToList(c, node);
             }
         
             /* no initializer */
@@ -407,8 +530,10 @@ static VMVALUE ParseScalarInitializer(ParseContext *c)
 }
 
 /* ParseArrayInitializers - parse array initializers */
-static void ParseArrayInitializers(ParseContext *c, VMVALUE size)
+static void ParseArrayInitializers(ParseContext *c, DataBlock *data)
 {
+    VMVALUE *next = data->initializers;
+    VMVALUE size = data->size;
     int done = VMFALSE;
     int tkn;
 
@@ -441,7 +566,7 @@ static void ParseArrayInitializers(ParseContext *c, VMVALUE size)
                 ParseError(c, "too many initializers");
 
             /* store the initial value */
-            putdword(c->g, value);
+            *next++ = value;
 
             switch (tkn = GetToken(c)) {
             case T_EOL:
@@ -462,11 +587,34 @@ static void ParseArrayInitializers(ParseContext *c, VMVALUE size)
     }
 }
 
-/* ClearArrayInitializers - clear the array initializers */
-static void ClearArrayInitializers(ParseContext *c, VMVALUE size)
+/* AddDataBlock - add a global data block */
+DataBlock *AddDataBlock(ParseContext *c, Symbol *symbol, VMVALUE size, int initialized)
 {
-    while (--size >= 0)
-        putdword(c->g, 0);
+    size_t blockSize = sizeof(DataBlock);
+    DataBlock *data;
+    
+    /* initialized data keeps its values until the image is built */
+    if (initialized)
+        blockSize += size * sizeof(VMVALUE);
+    
+    /* allocate the data block */
+    data = (DataBlock *)AllocateLowMemory(c->sys, blockSize, HEAP_DATA);
+    data->next = NULL;
+    data->symbol = symbol;
+    data->size = size;
+    if (initialized) {
+        data->initializers = (VMVALUE *)(data + 1);
+        memset(data->initializers, 0, size * sizeof(VMVALUE));
+    }
+    else
+        data->initializers = NULL;
+    
+    /* add it to the list of data blocks */
+    *c->pNextDataBlock = data;
+    c->pNextDataBlock = &data->next;
+    
+    /* return the data block */
+    return data;
 }
 
 /* ParseImpliedLetOrFunctionCall - parse an implied let statement or a function call */
@@ -488,7 +636,7 @@ static void ParseImpliedLetOrFunctionCall(ParseContext *c)
         node->u.callStatement.expr = expr;
         break;
     }
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     FRequire(c, T_EOL);
 }
 
@@ -500,7 +648,7 @@ static void ParseLet(ParseContext *c)
     ResolveVariableRef(c, node->u.letStatement.lvalue);
     FRequire(c, '=');
     node->u.letStatement.rvalue = ParseExpr(c);
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     FRequire(c, T_EOL);
 }
 
@@ -510,10 +658,10 @@ static void ParseIf(ParseContext *c)
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeIfStatement);
     int tkn;
     node->u.ifStatement.test = ParseExpr(c);
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     FRequire(c, T_THEN);
     PushBlock(c, BLOCK_IF, node);
-    c->bptr->pNextStatement = &node->u.ifStatement.thenStatements;
+    c->bptr->pStatements = &node->u.ifStatement.thenStatements;
     if ((tkn = GetToken(c)) != T_EOL) {
         ParseStatement(c, tkn);
         PopBlock(c);
@@ -524,16 +672,18 @@ static void ParseIf(ParseContext *c)
 /* ParseElseIf - parse the 'ELSE IF' statement */
 static void ParseElseIf(ParseContext *c)
 {
-    NodeListEntry **pNext;
     ParseTreeNode *node;
+    int first;
     switch (c->bptr->type) {
     case BLOCK_IF:
+        EndStatementList(c);
         node = NewParseTreeNode(c, NodeTypeIfStatement);
-        pNext = &c->bptr->node->u.ifStatement.elseStatements;
-        AddNodeToList(c, &pNext, node);
+        first = c->nodeCount;
+        AddNodeToList(c, node);
+        c->bptr->node->u.ifStatement.elseStatements = EndNodeList(c, first);
         c->bptr->node = node;
         node->u.ifStatement.test = ParseExpr(c);
-        c->bptr->pNextStatement = &node->u.ifStatement.thenStatements;
+        c->bptr->pStatements = &node->u.ifStatement.thenStatements;
         FRequire(c, T_THEN);
         FRequire(c, T_EOL);
         break;
@@ -548,8 +698,9 @@ static void ParseElse(ParseContext *c)
 {
     switch (c->bptr->type) {
     case BLOCK_IF:
+        EndStatementList(c);
         c->bptr->type = BLOCK_ELSE;
-        c->bptr->pNextStatement = &c->bptr->node->u.ifStatement.elseStatements;
+        c->bptr->pStatements = &c->bptr->node->u.ifStatement.elseStatements;
         FRequire(c, T_EOL);
         break;
     default:
@@ -579,14 +730,14 @@ static void ParseFor(ParseContext *c)
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeForStatement);
     int tkn;
 
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
 
     PushBlock(c, BLOCK_FOR, node);
-    c->bptr->pNextStatement = &node->u.forStatement.bodyStatements;
+    c->bptr->pStatements = &node->u.forStatement.bodyStatements;
 
     /* get the control variable */
     FRequire(c, T_IDENTIFIER);
-    node->u.forStatement.var = GetSymbolRef(c, c->token);
+    node->u.forStatement.var = GetSymbolRef(c, c->token, c->tokenHash);
 
     /* parse the starting value expression */
     FRequire(c, '=');
@@ -610,7 +761,7 @@ static void ParseNext(ParseContext *c)
     switch (c->bptr->type) {
     case BLOCK_FOR:
         FRequire(c, T_IDENTIFIER);
-        //if (GetSymbolRef(c, c->token) != c->bptr->node->u.forStatement.var)
+        //if (GetSymbolRef(c, c->token, c->tokenHash) != c->bptr->node->u.forStatement.var)
         //    ParseError(c, "wrong variable in NEXT");
         PopBlock(c);
         break;
@@ -626,9 +777,9 @@ static void ParseDo(ParseContext *c)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeLoopStatement);
     node->u.loopStatement.test = NULL;
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     PushBlock(c, BLOCK_DO, node);
-    c->bptr->pNextStatement = &node->u.loopStatement.bodyStatements;
+    c->bptr->pStatements = &node->u.loopStatement.bodyStatements;
     FRequire(c, T_EOL);
 }
 
@@ -637,9 +788,9 @@ static void ParseDoWhile(ParseContext *c)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeDoWhileStatement);
     node->u.loopStatement.test = ParseExpr(c);
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     PushBlock(c, BLOCK_DO, node);
-    c->bptr->pNextStatement = &node->u.loopStatement.bodyStatements;
+    c->bptr->pStatements = &node->u.loopStatement.bodyStatements;
     FRequire(c, T_EOL);
 }
 
@@ -648,9 +799,9 @@ static void ParseDoUntil(ParseContext *c)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeDoUntilStatement);
     node->u.loopStatement.test = ParseExpr(c);
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     PushBlock(c, BLOCK_DO, node);
-    c->bptr->pNextStatement = &node->u.loopStatement.bodyStatements;
+    c->bptr->pStatements = &node->u.loopStatement.bodyStatements;
     FRequire(c, T_EOL);
 }
 
@@ -722,17 +873,17 @@ static void ParseReturn(ParseContext *c)
     }
     
     /* add the statement to the current function */
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
 }
 
 /* BuildHandlerFunctionCall - compile a call to a runtime print function */
 static ParseTreeNode *BuildHandlerCall(ParseContext *c, char *name, ParseTreeNode *devExpr, ParseTreeNode *expr)
 {
     ParseTreeNode *functionNode, *callNode, *node;
-    NodeListEntry **pNext;
     Symbol *symbol;
+    int first;
 
-    if (!(symbol = FindGlobal(c, name)))
+    if (!(symbol = FindGlobal(c, name, HashName(name))))
         ParseError(c, "print helper not defined: %s", name);
         
     functionNode = NewParseTreeNode(c, NodeTypeGlobalRef);
@@ -741,16 +892,17 @@ static ParseTreeNode *BuildHandlerCall(ParseContext *c, char *name, ParseTreeNod
     /* intialize the function call node */
     callNode = NewParseTreeNode(c, NodeTypeFunctionCall);
     callNode->u.functionCall.fcn = functionNode;
-    callNode->u.functionCall.args = NULL;
-    pNext = &callNode->u.functionCall.args;
+    first = c->nodeCount;
     
+    AddNodeToList(c, devExpr);
+    ++callNode->u.functionCall.argc;
+
     if (expr) {
-        AddNodeToList(c, &pNext, expr);
+        AddNodeToList(c, expr);
         ++callNode->u.functionCall.argc;
     }
 
-    AddNodeToList(c, &pNext, devExpr);
-    ++callNode->u.functionCall.argc;
+    callNode->u.functionCall.args = EndNodeList(c, first);
 
     /* build the function call statement */
     node = NewParseTreeNode(c, NodeTypeCallStatement);
@@ -785,7 +937,7 @@ static void ParsePrint(ParseContext *c)
         switch (tkn) {
         case ',':
             needNewline = VMFALSE;
-            AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "printTab", devExpr, NULL));
+            AddNodeToList(c, BuildHandlerCall(c, "printTab", devExpr, NULL));
             break;
         case ';':
             needNewline = VMFALSE;
@@ -794,26 +946,26 @@ static void ParsePrint(ParseContext *c)
             needNewline = VMTRUE;
             expr = NewParseTreeNode(c, NodeTypeStringLit);
             expr->u.stringLit.string = AddString(c, c->token);
-            AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "printStr", devExpr, expr));
+            AddNodeToList(c, BuildHandlerCall(c, "printStr", devExpr, expr));
             break;
         default:
             needNewline = VMTRUE;
             SaveToken(c, tkn);
             expr = ParseExpr(c);
-            AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "printInt", devExpr, expr));
+            AddNodeToList(c, BuildHandlerCall(c, "printInt", devExpr, expr));
             break;
         }
     }
 
     if (needNewline)
-        AddNodeToList(c, &c->bptr->pNextStatement, BuildHandlerCall(c, "printNL", devExpr, NULL));
+        AddNodeToList(c, BuildHandlerCall(c, "printNL", devExpr, NULL));
 }
 
 /* ParseEnd - parse the 'END' statement */
 static void ParseEnd(ParseContext *c)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeEndStatement);
-    AddNodeToList(c, &c->bptr->pNextStatement, node);
+    AddNodeToList(c, node);
     FRequire(c, T_EOL);
 }
 
@@ -827,293 +979,89 @@ VMVALUE ParseIntegerConstant(ParseContext *c)
     return expr->u.integerLit.value;
 }
 
-/* ParseExpr - handle the OR operator */
+/* ParseExpr - parse an expression */
 static ParseTreeNode *ParseExpr(ParseContext *c)
 {
-    ParseTreeNode *node;
-    int tkn;
-    node = ParseExpr2(c);
-    if ((tkn = GetToken(c)) == T_OR) {
-        ParseTreeNode *node2 = NewParseTreeNode(c, NodeTypeDisjunction);
-        NodeListEntry **pNext = &node2->u.exprList.exprs;
-        AddNodeToList(c, &pNext, node);
-        do {
-            AddNodeToList(c, &pNext, ParseExpr2(c));
-        } while ((tkn = GetToken(c)) == T_OR);
-        node = node2;
-    }
-    SaveToken(c, tkn);
-    return node;
-}
-
-/* ParseExpr2 - handle the AND operator */
-static ParseTreeNode *ParseExpr2(ParseContext *c)
-{
-    ParseTreeNode *node;
-    int tkn;
-    node = ParseExpr3(c);
-    if ((tkn = GetToken(c)) == T_AND) {
-        ParseTreeNode *node2 = NewParseTreeNode(c, NodeTypeConjunction);
-        NodeListEntry **pNext = &node2->u.exprList.exprs;
-        AddNodeToList(c, &pNext, node);
-        do {
-            AddNodeToList(c, &pNext, ParseExpr3(c));
-        } while ((tkn = GetToken(c)) == T_AND);
-        node = node2;
-    }
-    SaveToken(c, tkn);
-    return node;
-}
-
-/* ParseExpr3 - handle the BXOR operator */
-static ParseTreeNode *ParseExpr3(ParseContext *c)
-{
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr4(c);
-    while ((tkn = GetToken(c)) == '^') {
-        expr2 = ParseExpr4(c);
-        if (IsIntegerLit(expr) && IsIntegerLit(expr2))
-            expr->u.integerLit.value = expr->u.integerLit.value ^ expr2->u.integerLit.value;
-        else
-            expr = MakeBinaryOpNode(c, OP_BXOR, expr, expr2);
-    }
-    SaveToken(c,tkn);
-    return expr;
-}
-
-/* ParseExpr4 - handle the BOR operator */
-static ParseTreeNode *ParseExpr4(ParseContext *c)
-{
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr5(c);
-    while ((tkn = GetToken(c)) == '|') {
-        expr2 = ParseExpr5(c);
-        if (IsIntegerLit(expr) && IsIntegerLit(expr2))
-            expr->u.integerLit.value = expr->u.integerLit.value | expr2->u.integerLit.value;
-        else
-            expr = MakeBinaryOpNode(c, OP_BOR, expr, expr2);
-    }
-    SaveToken(c,tkn);
-    return expr;
-}
-
-/* ParseExpr5 - handle the BAND operator */
-static ParseTreeNode *ParseExpr5(ParseContext *c)
-{
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr6(c);
-    while ((tkn = GetToken(c)) == '&') {
-        expr2 = ParseExpr6(c);
-        if (IsIntegerLit(expr) && IsIntegerLit(expr2))
-            expr->u.integerLit.value = expr->u.integerLit.value & expr2->u.integerLit.value;
-        else
-            expr = MakeBinaryOpNode(c, OP_BAND, expr, expr2);
-    }
-    SaveToken(c,tkn);
-    return expr;
-}
-
-/* ParseExpr6 - handle the '=' and '<>' operators */
-static ParseTreeNode *ParseExpr6(ParseContext *c)
-{
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr7(c);
-    while ((tkn = GetToken(c)) == '=' || tkn == T_NE) {
-        int op;
-        expr2 = ParseExpr7(c);
-        switch (tkn) {
-        case '=':
-            op = OP_EQ;
-            break;
-        case T_NE:
-            op = OP_NE;
-            break;
-        default:
-            /* not reached */
-            op = 0;
-            break;
-        }
-        expr = MakeBinaryOpNode(c, op, expr, expr2);
-    }
-    SaveToken(c,tkn);
-    return expr;
-}
-
-/* ParseExpr7 - handle the '<', '<=', '>=' and '>' operators */
-static ParseTreeNode *ParseExpr7(ParseContext *c)
-{
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr8(c);
-    while ((tkn = GetToken(c)) == '<' || tkn == T_LE || tkn == T_GE || tkn == '>') {
-        int op;
-        expr2 = ParseExpr8(c);
-        switch (tkn) {
-        case '<':
-            op = OP_LT;
-            break;
-        case T_LE:
-            op = OP_LE;
-            break;
-        case T_GE:
-            op = OP_GE;
-            break;
-        case '>':
-            op = OP_GT;
-            break;
-        default:
-            /* not reached */
-            op = 0;
-            break;
-        }
-        expr = MakeBinaryOpNode(c, op, expr, expr2);
-    }
-    SaveToken(c,tkn);
-    return expr;
+    return ParseBinaryExpr(c, PREC_OR);
 }
 
-/* ParseExpr8 - handle the '<<' and '>>' operators */
-static ParseTreeNode *ParseExpr8(ParseContext *c)
+/* ParseBinaryExpr - parse an expression containing binary operators of at least a precedence */
+static ParseTreeNode *ParseBinaryExpr(ParseContext *c, int precedence)
 {
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr9(c);
-    while ((tkn = GetToken(c)) == T_SHL || tkn == T_SHR) {
-        expr2 = ParseExpr9(c);
-        if (IsIntegerLit(expr) && IsIntegerLit(expr2)) {
-            switch (tkn) {
-            case T_SHL:
-                expr->u.integerLit.value = expr->u.integerLit.value << expr2->u.integerLit.value;
-                break;
-            case T_SHR:
-                expr->u.integerLit.value = expr->u.integerLit.value >> expr2->u.integerLit.value;
-                break;
-            default:
-                /* not reached */
-                break;
-            }
+    ParseTreeNode *node, *node2;
+    int tkn, i;
+    node = ParseUnaryExpr(c);
+    tkn = GetToken(c);
+    while ((i = FindBinaryOp(tkn)) >= 0 && btab[i].precedence >= precedence) {
+        
+        /* OR and AND build a list of the operands to evaluate with short circuits */
+        if (btab[i].precedence <= PREC_AND) {
+            int first = c->nodeCount;
+            node2 = NewParseTreeNode(c, btab[i].precedence == PREC_OR ? NodeTypeDisjunction : NodeTypeConjunction);
+            AddNodeToList(c, node);
+            do {
+                AddNodeToList(c, ParseBinaryExpr(c, btab[i].precedence + 1));
+            } while ((tkn = GetToken(c)) == btab[i].token);
+            node2->u.exprList.exprs = EndNodeList(c, first);
+            node = node2;
         }
+        
+        /* the other operators build a binary operator node or a folded constant */
         else {
-            int op;
-            switch (tkn) {
-            case T_SHL:
-                op = OP_SHL;
-                break;
-            case T_SHR:
-                op = OP_SHR;
-                break;
-            default:
-                /* not reached */
-                op = 0;
-                break;
-            }
-            expr = MakeBinaryOpNode(c, op, expr, expr2);
+            node2 = ParseBinaryExpr(c, btab[i].precedence + 1);
+            if (btab[i].fold && IsIntegerLit(node) && IsIntegerLit(node2))
+                node->u.integerLit.value = FoldBinaryOp(c, btab[i].op, node->u.integerLit.value, node2->u.integerLit.value);
+            else
+                node = MakeBinaryOpNode(c, btab[i].op, node, node2);
+            tkn = GetToken(c);
         }
     }
-    SaveToken(c,tkn);
-    return expr;
+    SaveToken(c, tkn);
+    return node;
 }
 
-/* ParseExpr9 - handle the '+' and '-' operators */
-static ParseTreeNode *ParseExpr9(ParseContext *c)
+/* FindBinaryOp - find the btab index of a binary operator (-1 if the token isn't one) */
+static int FindBinaryOp(int tkn)
 {
-    ParseTreeNode *expr, *expr2;
-    int tkn;
-    expr = ParseExpr10(c);
-    while ((tkn = GetToken(c)) == '+' || tkn == '-') {
-        expr2 = ParseExpr10(c);
-        if (IsIntegerLit(expr) && IsIntegerLit(expr2)) {
-            switch (tkn) {
-            case '+':
-                expr->u.integerLit.value = expr->u.integerLit.value + expr2->u.integerLit.value;
-                break;
-            case '-':
-                expr->u.integerLit.value = expr->u.integerLit.value - expr2->u.integerLit.value;
-                break;
-            default:
-                /* not reached */
-                break;
-            }
-        }
-        else {
-            int op;
-            switch (tkn) {
-            case '+':
-                op = OP_ADD;
-                break;
-            case '-':
-                op = OP_SUB;
-                break;
-            default:
-                /* not reached */
-                op = 0;
-                break;
-            }
-            expr = MakeBinaryOpNode(c, op, expr, expr2);
-        }
-    }
-    SaveToken(c, tkn);
-    return expr;
+    return tkn >= 0 && tkn <= T_EOF ? btabIndex[tkn] - 1 : -1;
 }
 
-/* ParseExpr10 - handle the '*', '/' and MOD operators */
-static ParseTreeNode *ParseExpr10(ParseContext *c)
+/* FoldBinaryOp - evaluate a binary operator with constant operands */
+static VMVALUE FoldBinaryOp(ParseContext *c, int op, VMVALUE left, VMVALUE right)
 {
-    ParseTreeNode *node, *node2;
-    int tkn;
-    node = ParseExpr11(c);
-    while ((tkn = GetToken(c)) == '*' || tkn == '/' || tkn == T_MOD) {
-        node2 = ParseExpr11(c);
-        if (IsIntegerLit(node) && IsIntegerLit(node2)) {
-            switch (tkn) {
-            case '*':
-                node->u.integerLit.value = node->u.integerLit.value * node2->u.integerLit.value;
-                break;
-            case '/':
-                if (node2->u.integerLit.value == 0)
-                    ParseError(c, "division by zero in constant expression");
-                node->u.integerLit.value = node->u.integerLit.value / node2->u.integerLit.value;
-                break;
-            case T_MOD:
-                if (node2->u.integerLit.value == 0)
-                    ParseError(c, "division by zero in constant expression");
-                node->u.integerLit.value = node->u.integerLit.value % node2->u.integerLit.value;
-                break;
-            default:
-                /* not reached */
-                break;
-            }
-        }
-        else {
-            int op;
-            switch (tkn) {
-            case '*':
-                op = OP_MUL;
-                break;
-            case '/':
-                op = OP_DIV;
-                break;
-            case T_MOD:
-                op = OP_REM;
-                break;
-            default:
-                /* not reached */
-                op = 0;
-                break;
-            }
-            node = MakeBinaryOpNode(c, op, node, node2);
-        }
+    switch (op) {
+    case OP_ADD:
+        return left + right;
+    case OP_SUB:
+        return left - right;
+    case OP_MUL:
+        return left * right;
+    case OP_DIV:
+        if (right == 0)
+            ParseError(c, "division by zero in constant expression");
+        return left / right;
+    case OP_REM:
+        if (right == 0)
+            ParseError(c, "division by zero in constant expression");
+        return left % right;
+    case OP_SHL:
+        return left << right;
+    case OP_SHR:
+        return left >> right;
+    case OP_BAND:
+        return left & right;
+    case OP_BOR:
+        return left | right;
+    case OP_BXOR:
+        return left ^ right;
+    default:
+        /* not reached */
+        return 0;
     }
-    SaveToken(c, tkn);
-    return node;
 }
 
-/* ParseExpr11 - handle unary operators */
-static ParseTreeNode *ParseExpr11(ParseContext *c)
+/* ParseUnaryExpr - handle unary operators */
+static ParseTreeNode *ParseUnaryExpr(ParseContext *c)
 {
     ParseTreeNode *node;
     int tkn;
@@ -1176,6 +1124,7 @@ static ParseTreeNode *ParseArrayReference(ParseContext *c, ParseTreeNode *arrayN
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeArrayRef);
 
     /* setup the array reference */
+    node->type = &c->integerType;
     node->u.arrayRef.array = arrayNode;
 
     /* get the index expression */
@@ -1190,26 +1139,23 @@ static ParseTreeNode *ParseArrayReference(ParseContext *c, ParseTreeNode *arrayN
 static ParseTreeNode *ParseCall(ParseContext *c, ParseTreeNode *functionNode)
 {
     ParseTreeNode *node = NewParseTreeNode(c, NodeTypeFunctionCall);
-    NodeListEntry **pNext;
+    int first = c->nodeCount;
     int tkn;
 
     /* intialize the function call node */
     ResolveFunctionRef(c, functionNode);
     node->u.functionCall.fcn = functionNode;
     node->type = &c->integerType;
-    pNext = &node->u.functionCall.args;
 
     /* parse the argument list */
     if ((tkn = GetToken(c)) != ')') {
         SaveToken(c, tkn);
         do {
-            NodeListEntry *actual = (NodeListEntry *)AllocateHighMemory(c->sys, sizeof(NodeListEntry));
-            actual->node = ParseExpr(c);
-            actual->next = node->u.functionCall.args;
-            node->u.functionCall.args = actual;
+            AddNodeToList(c, ParseExpr(c));
             ++node->u.functionCall.argc;
         } while ((tkn = GetToken(c)) == ',');
         Require(c, tkn, ')');
+        node->u.functionCall.args = EndNodeList(c, first);
     }
 
     /* return the function call node */
@@ -1236,7 +1182,7 @@ static ParseTreeNode *ParseSimplePrimary(ParseContext *c)
         node->u.stringLit.string = AddString(c, c->token);
         break;
     case T_IDENTIFIER:
-        node = GetSymbolRef(c, c->token);
+        node = GetSymbolRef(c, c->token, c->tokenHash);
         break;
     default:
         ParseError(c, "Expecting a primary expression");
@@ -1273,13 +1219,13 @@ static void ResolveFunctionRef(ParseContext *c, ParseTreeNode *node)
 }
 
 /* GetSymbolRef - setup a symbol reference */
-static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name)
+static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name, SymbolHash hash)
 {
     ParseTreeNode *node;
     Symbol *symbol;
 
     /* handle local variables within a function or subroutine */
-    if (c->currentFunction != c->mainFunction && (symbol = FindLocal(c, name)) != NULL) {
+    if (c->currentFunction != c->mainFunction && (symbol = FindLocal(c, name, hash)) != NULL) {
         if (symbol->storageClass == SC_CONSTANT) {
             node = NewParseTreeNode(c, NodeTypeIntegerLit);
             node->type = &c->integerType;
@@ -1293,24 +1239,17 @@ static ParseTreeNode *GetSymbolRef(ParseContext *c, const char *name)
     }
 
     /* handle function or subroutine arguments or the return value symbol */
-    else if (c->currentFunction != c->mainFunction && (symbol = FindArgument(c, name)) != NULL) {
+    else if (c->currentFunction != c->mainFunction && (symbol = FindArgument(c, name, hash)) != NULL) {
         node = NewParseTreeNode(c, NodeTypeArgumentRef);
         node->type = symbol->type;
         node->u.symbolRef.symbol = symbol;
     }
 
-    /* handle global symbols */
-    else if ((symbol = FindGlobal(c, c->token)) != NULL) {
-        if (symbol->storageClass == SC_CONSTANT) {
-            node = NewParseTreeNode(c, NodeTypeIntegerLit);
-            node->type = &c->integerType;
-            node->u.integerLit.value = symbol->value;
-        }
-        else {
-            node = NewParseTreeNode(c, NodeTypeGlobalRef);
-            node->type = symbol->type;
-            node->u.symbolRef.symbol = symbol;
-        }
+    /* handle global symbols (arrays are placed when the image is built) */
+    else if ((symbol = FindGlobal(c, name, hash)) != NULL) {
+        node = NewParseTreeNode(c, NodeTypeGlobalRef);
+        node->type = symbol->type;
+        node->u.symbolRef.symbol = symbol;
     }
 
     /* handle undefined symbols */
@@ -1452,31 +1391,143 @@ static void PushBlock(ParseContext *c, BlockType type, ParseTreeNode *node)
         ParseError(c, "statements too deeply nested");
     c->bptr->type = type;
     c->bptr->node = node;
+    c->bptr->firstStatement = c->nodeCount;
 }
 
-/* PopBlock - pop a block off the stack */
+/* PopBlock - end the statement list of a block and pop it off the stack */
 static void PopBlock(ParseContext *c)
 {
+    EndStatementList(c);
     --c->bptr;
 }
 
+/* EndStatementList - store the statements parsed so far in the current block */
+void EndStatementList(ParseContext *c)
+{
+    *c->bptr->pStatements = EndNodeList(c, c->bptr->firstStatement);
+}
+
 /* NewParseTreeNode - allocate a new parse tree node */
+/* (only the part of the union used by the node type is allocated) */
 ParseTreeNode *NewParseTreeNode(ParseContext *c, int type)
 {
-    ParseTreeNode *node = (ParseTreeNode *)AllocateHighMemory(c->sys, sizeof(ParseTreeNode));
-    memset(node, 0, sizeof(ParseTreeNode));
+    size_t size = NodeSize(type);
+    ParseTreeNode *node = (ParseTreeNode *)AllocateHighMemory(c->sys, size, HEAP_NODES);
+    memset(node, 0, size);
     node->nodeType = type;
+    node->lineNumber = c->lineNumber;
     return node;
 }
 
-/* AddNodeToList - add a node to a parse tree node list */
-void AddNodeToList(ParseContext *c, NodeListEntry ***ppNextEntry, ParseTreeNode *node)
+/* size of a parse tree node using a member of the node union */
+#define UnionNodeSize(member)   (offsetof(ParseTreeNode, u) + sizeof(((ParseTreeNode *)0)->u.member))
+
+/* NodeSize - get the size of a parse tree node of a given type */
+static size_t NodeSize(int type)
+{
+    switch (type) {
+    case NodeTypeFunctionDefinition:
+        return UnionNodeSize(functionDefinition);
+    case NodeTypeLetStatement:
+        return UnionNodeSize(letStatement);
+    case NodeTypeIfStatement:
+        return UnionNodeSize(ifStatement);
+    case NodeTypeForStatement:
+        return UnionNodeSize(forStatement);
+    case NodeTypeDoWhileStatement:
+    case NodeTypeDoUntilStatement:
+    case NodeTypeLoopStatement:
+    case NodeTypeLoopWhileStatement:
+    case NodeTypeLoopUntilStatement:
+        return UnionNodeSize(loopStatement);
+    case NodeTypeReturnStatement:
+        return UnionNodeSize(returnStatement);
+    case NodeTypeEndStatement:
+        return offsetof(ParseTreeNode, u);
+    case NodeTypeCallStatement:
+        return UnionNodeSize(callStatement);
+    case NodeTypeAsmStatement:
+        return UnionNodeSize(asmStatement);
+    case NodeTypeGlobalRef:
+    case NodeTypeArgumentRef:
+    case NodeTypeLocalRef:
+        return UnionNodeSize(symbolRef);
+    case NodeTypeStringLit:
+        return UnionNodeSize(stringLit);
+    case NodeTypeIntegerLit:
+        return UnionNodeSize(integerLit);
+    case NodeTypeUnaryOp:
+        return UnionNodeSize(unaryOp);
+    case NodeTypeBinaryOp:
+        return UnionNodeSize(binaryOp);
+    case NodeTypeArrayRef:
+        return UnionNodeSize(arrayRef);
+    case NodeTypeFunctionCall:
+        return UnionNodeSize(functionCall);
+    case NodeTypeDisjunction:
+    case NodeTypeConjunction:
+        return UnionNodeSize(exprList);
+    default:
+        return sizeof(ParseTreeNode);
+    }
+}
+
+/* AddNodeToList - add a node to the list being parsed */
+/* (lists nest so their nodes are kept on a stack until each list is complete) */
+void AddNodeToList(ParseContext *c, ParseTreeNode *node)
 {
-    NodeListEntry *entry = (NodeListEntry *)AllocateHighMemory(c->sys, sizeof(NodeListEntry));
-    entry->node = node;
-    entry->next = NULL;
-    **ppNextEntry = entry;
-    *ppNextEntry = &entry->next;
+    int index = c->nodeCount++;
+    FindNodeChunk(c, index)->nodes[index - c->nodeChunkBase] = node;
+}
+
+/* EndNodeList - move the nodes added since the start of a list to a NULL terminated array */
+ParseTreeNode **EndNodeList(ParseContext *c, int first)
+{
+    int count = c->nodeCount - first, index, n;
+    ParseTreeNode **list;
+    NodeChunk *chunk;
+    if (count == 0)
+        return NULL;
+    list = (ParseTreeNode **)AllocateHighMemory(c->sys, (count + 1) * sizeof(ParseTreeNode *), HEAP_NODE_LISTS);
+    
+    /* copy the part of the list in each chunk */
+    for (index = first; index < c->nodeCount; index += n) {
+        chunk = FindNodeChunk(c, index);
+        n = c->nodeChunkBase + NODECHUNKSIZE - index;
+        if (n > c->nodeCount - index)
+            n = c->nodeCount - index;
+        memcpy(&list[index - first], &chunk->nodes[index - c->nodeChunkBase], n * sizeof(ParseTreeNode *));
+    }
+    list[count] = NULL;
+    
+    c->nodeCount = first;
+    return list;
+}
+
+/* FindNodeChunk - find the chunk of the list stack containing an index adding chunks as needed */
+static NodeChunk *FindNodeChunk(ParseContext *c, int index)
+{
+    NodeChunk *chunk = c->nodeChunk;
+    int base = c->nodeChunkBase;
+    
+    /* start from the first chunk if the index is before the one used last */
+    if (index < base) {
+        chunk = &c->nodeStack;
+        base = 0;
+    }
+    
+    while (index - base >= NODECHUNKSIZE) {
+        if (!chunk->next) {
+            chunk->next = (NodeChunk *)AllocateLowMemory(c->sys, sizeof(NodeChunk), HEAP_NODE_LISTS);
+            chunk->next->next = NULL;
+        }
+        chunk = chunk->next;
+        base += NODECHUNKSIZE;
+    }
+    
+    c->nodeChunk = chunk;
+    c->nodeChunkBase = base;
+    return chunk;
 }
 
 /* NodeTypeName - get the name of a node type */
@@ -1492,19 +1543,32 @@ static int IsIntegerLit(ParseTreeNode *node)
 }
 
 /* AddString - add a string to the string table */
-static String *AddString(ParseContext *c, const char *value)
+String *AddString(ParseContext *c, const char *value)
 {
-    String *str;
+    uint32_t hash = NAMEHASH_INIT;
+    String *str, **pBucket;
+    const char *p;
+    size_t length;
+    
+    /* compute the hash and the length of the string */
+    for (p = value; *p != '\0'; ++p)
+        hash = StringHashStep(hash, *p);
+    length = p - value;
     
     /* check to see if the string is already in the table */
-    for (str = c->strings; str != NULL; str = str->next)
-        if (strcmp(value, str->data) == 0)
+    pBucket = &c->stringBuckets[hash & (STRINGBUCKETS - 1)];
+    for (str = *pBucket; str != NULL; str = str->hashNext)
+        if (str->hash == hash && str->length == length && memcmp(value, str->data, length) == 0)
             return str;
 
     /* allocate the string structure */
-    str = (String *)AllocateLowMemory(c->sys, sizeof(String) + strlen(value));
+    str = (String *)AllocateLowMemory(c->sys, sizeof(String) + length, HEAP_STRINGS);
     memset(str, 0, sizeof(String));
-    strcpy(str->data, value);
+    memcpy(str->data, value, length + 1);
+    str->hash = hash;
+    str->length = length;
+    str->hashNext = *pBucket;
+    *pBucket = str;
     str->next = c->strings;
     c->strings = str;
 
@@ -1519,7 +1583,7 @@ void DumpStrings(ParseContext *c)
     if (str) {
         VM_printf("Strings:\n");
         for (; str != NULL; str = str->next)
-            VM_printf("  '%s' %08x\n", str->data, (VMVALUE)((uint8_t *)str->data - c->g->codeBuf));
+            VM_printf("  '%s' %08x%s\n", str->data, str->value, str->placed ? "" : " <unplaced>");
     }
 }
 
@@ -12,6 +12,16 @@
 #include <ctype.h>
 #include "compile.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* character classes that can be skipped a block at a time */
+#define CLASS_SPACE         0   /* white space */
+#define CLASS_IDENTIFIER    1   /* letters, digits, '$', '%' and '_' */
+#define CLASS_DIGIT         2   /* digits and '_' */
+#define CLASS_COMMENT       3   /* anything but '*' in a block comment */
+
 /* keyword table */
 /*static*/ struct {
     char *keyword;
@@ -19,7 +29,6 @@
 } ktab[] = {
 
 /* these must be in the same order as the int enum */
-{   "INCLUDE",  T_INCLUDE   },
 {   "REM",      T_REM       },
 {   "DIM",      T_DIM       },
 {   "FUNCTION", T_FUNCTION  },
@@ -50,9 +59,18 @@
 {   NULL,       0           }
 };
 
+/* crunched keywords are stored as a byte with the high bit set plus the ktab index */
+#define KEYWORD_BYTE    0x80
+#define KEYWORD_COUNT   ((int)(sizeof(ktab) / sizeof(ktab[0])) - 1)
+
 /* local function prototypes */
 static int GetToken1(ParseContext *c);
+static int WordToken(ParseContext *c, int ch);
 static int IdentifierToken(ParseContext *c, int ch);
+static int NextKeyword(ParseContext *c);
+static int FindKeyword(const char *name, int len);
+static const char *CopyCommentRest(const char *src, char **pDst, char *top, int *pInComment);
+static const char *CopyLiteral(const char *src, char **pDst, char *top, int restOfLine, int *pInComment);
 static int IdentifierCharP(int ch);
 static int NumberToken(ParseContext *c, int ch);
 static int HexNumberToken(ParseContext *c);
@@ -61,6 +79,8 @@ static int StringToken(ParseContext *c);
 static int CharToken(ParseContext *c);
 static int LiteralChar(ParseContext *c);
 static int SkipComment(ParseContext *c);
+static const char *SpanClass(const char *p, int cls);
+static int CharInClassP(int ch, int cls);
 static int XGetC(ParseContext *c);
 
 /* InitScan - initialize the scanner */
@@ -222,7 +242,7 @@ static int GetToken1(ParseContext *c)
     ch = SkipSpaces(c);
 
     /* remember the start of the current token */
-    c->tokenOffset = (int)(c->sys->linePtr - c->sys->lineBuf);
+    c->tokenOffset = (int)(c->sys->linePtr - c->sys->lineStart);
 
     /* check the next character */
     switch (ch) {
@@ -276,83 +296,67 @@ static int GetToken1(ParseContext *c)
     default:
         if (isdigit(ch))
             tkn = NumberToken(c, ch);
-        else if (IdentifierCharP(ch)) {
+        else if ((tkn = WordToken(c, ch)) != T_NONE) {
             char *savePtr;
-            switch (tkn = IdentifierToken(c,ch)) {
+            switch (tkn) {
             case T_ELSE:
                 savePtr = c->sys->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_IF:
-                        tkn = T_ELSE_IF;
-                        break;
-                    default:
-                        c->sys->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
+                switch (NextKeyword(c)) {
+                case T_IF:
+                    tkn = T_ELSE_IF;
+                    break;
+                default:
                     c->sys->linePtr = savePtr;
+                    break;
+                }
                 break;
             case T_END:
                 savePtr = c->sys->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_FUNCTION:
-                        tkn = T_END_FUNCTION;
-                        break;
-                    case T_SUB:
-                        tkn = T_END_SUB;
-                        break;
-                    case T_IF:
-                        tkn = T_END_IF;
-                        break;
-                    case T_ASM:
-                        tkn = T_END_ASM;
-                        break;
-                    default:
-                        c->sys->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
+                switch (NextKeyword(c)) {
+                case T_FUNCTION:
+                    tkn = T_END_FUNCTION;
+                    break;
+                case T_SUB:
+                    tkn = T_END_SUB;
+                    break;
+                case T_IF:
+                    tkn = T_END_IF;
+                    break;
+                case T_ASM:
+                    tkn = T_END_ASM;
+                    break;
+                default:
                     c->sys->linePtr = savePtr;
+                    break;
+                }
                 break;
             case T_DO:
                 savePtr = c->sys->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_WHILE:
-                        tkn = T_DO_WHILE;
-                        break;
-                    case T_UNTIL:
-                        tkn = T_DO_UNTIL;
-                        break;
-                    default:
-                        c->sys->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
+                switch (NextKeyword(c)) {
+                case T_WHILE:
+                    tkn = T_DO_WHILE;
+                    break;
+                case T_UNTIL:
+                    tkn = T_DO_UNTIL;
+                    break;
+                default:
                     c->sys->linePtr = savePtr;
+                    break;
+                }
                 break;
             case T_LOOP:
                 savePtr = c->sys->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_WHILE:
-                        tkn = T_LOOP_WHILE;
-                        break;
-                    case T_UNTIL:
-                        tkn = T_LOOP_UNTIL;
-                        break;
-                    default:
-                        c->sys->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
+                switch (NextKeyword(c)) {
+                case T_WHILE:
+                    tkn = T_LOOP_WHILE;
+                    break;
+                case T_UNTIL:
+                    tkn = T_LOOP_UNTIL;
+                    break;
+                default:
                     c->sys->linePtr = savePtr;
+                    break;
+                }
                 break;
             }
         }
@@ -364,31 +368,279 @@ static int GetToken1(ParseContext *c)
     return tkn;
 }
 
+/* WordToken - get a keyword or identifier starting with a character (T_NONE if it doesn't start one) */
+static int WordToken(ParseContext *c, int ch)
+{
+    int tkn;
+    
+    /* keywords in crunched lines are already tokens */
+    if ((tkn = CrunchedToken(ch)) != T_NONE) {
+        strcpy(c->token, ktab[ch - KEYWORD_BYTE].keyword);
+        return tkn;
+    }
+    
+    /* otherwise, scan the identifier and check for a keyword */
+    return ch != EOF && IdentifierCharP(ch) ? IdentifierToken(c, ch) : T_NONE;
+}
+
 /* IdentifierToken - get an identifier */
+/* (the case-folded hash used to look it up in the symbol tables is computed as it is read) */
 static int IdentifierToken(ParseContext *c, int ch)
 {
+    SymbolHash hash;
     int len, i;
     char *p;
 
     /* get the identifier */
     p = c->token; *p++ = ch; len = 1;
+    hash = NameHashStep(NAMEHASH_INIT, ch);
+    
+    /* copy the characters that can be spanned without looking for comments */
+    if (!c->inComment) {
+        const char *end = SpanClass(c->sys->linePtr, CLASS_IDENTIFIER);
+        if ((len += (int)(end - c->sys->linePtr)) > MAXTOKEN)
+            ParseError(c, "Identifier too long");
+        while (c->sys->linePtr < end) {
+            ch = *c->sys->linePtr++;
+            *p++ = ch;
+            hash = NameHashStep(hash, ch);
+        }
+    }
+    
+    /* get the rest of the identifier */
     while ((ch = GetChar(c)) != EOF && IdentifierCharP(ch)) {
         if (++len > MAXTOKEN)
             ParseError(c, "Identifier too long");
         *p++ = ch;
+        hash = NameHashStep(hash, ch);
     }
     UngetC(c);
     *p = '\0';
+    c->tokenHash = hash;
 
     /* check to see if it is a keyword */
-    for (i = 0; ktab[i].keyword != NULL; ++i)
-        if (strcasecmp(ktab[i].keyword, c->token) == 0)
-            return ktab[i].token;
+    if ((i = FindKeyword(c->token, len)) >= 0)
+        return ktab[i].token;
 
     /* otherwise, it is an identifier */
     return T_IDENTIFIER;
 }
 
+/* NextKeyword - get the keyword that follows one that can start a compound keyword */
+/* (returns T_NONE if the next word isn't a keyword and doesn't change the current token) */
+static int NextKeyword(ParseContext *c)
+{
+    char *start;
+    int ch, i;
+
+    /* keywords in crunched lines are already tokens */
+    if ((i = CrunchedToken(ch = SkipSpaces(c))) != T_NONE)
+        return i;
+
+    /* otherwise, check the word in place */
+    if (ch == EOF || !IdentifierCharP(ch) || isdigit(ch))
+        return T_NONE;
+    start = c->sys->linePtr - 1;
+    while (IdentifierCharP((uint8_t)*c->sys->linePtr))
+        ++c->sys->linePtr;
+    return (i = FindKeyword(start, c->sys->linePtr - start)) >= 0 ? ktab[i].token : T_NONE;
+}
+
+/* FindKeyword - find the ktab index of a keyword (-1 if it isn't one) */
+/* (no two keywords have the same length and first letter except AND and ASM) */
+static int FindKeyword(const char *name, int len)
+{
+    int tkn;
+
+    /* find the only keyword that could match */
+    switch (len) {
+    case 2:
+        switch (toupper((uint8_t)name[0])) {
+        case 'A':   tkn = T_AS;         break;
+        case 'D':   tkn = T_DO;         break;
+        case 'I':   tkn = T_IF;         break;
+        case 'O':   tkn = T_OR;         break;
+        case 'T':   tkn = T_TO;         break;
+        default:    return -1;
+        }
+        break;
+    case 3:
+        switch (toupper((uint8_t)name[0])) {
+        case 'A':   tkn = toupper((uint8_t)name[1]) == 'N' ? T_AND : T_ASM; break;
+        case 'D':   tkn = T_DIM;        break;
+        case 'E':   tkn = T_END;        break;
+        case 'F':   tkn = T_FOR;        break;
+        case 'L':   tkn = T_LET;        break;
+        case 'M':   tkn = T_MOD;        break;
+        case 'N':   tkn = T_NOT;        break;
+        case 'R':   tkn = T_REM;        break;
+        case 'S':   tkn = T_SUB;        break;
+        default:    return -1;
+        }
+        break;
+    case 4:
+        switch (toupper((uint8_t)name[0])) {
+        case 'E':   tkn = T_ELSE;       break;
+        case 'G':   tkn = T_GOTO;       break;
+        case 'L':   tkn = T_LOOP;       break;
+        case 'N':   tkn = T_NEXT;       break;
+        case 'S':   tkn = T_STEP;       break;
+        case 'T':   tkn = T_THEN;       break;
+        default:    return -1;
+        }
+        break;
+    case 5:
+        switch (toupper((uint8_t)name[0])) {
+        case 'P':   tkn = T_PRINT;      break;
+        case 'U':   tkn = T_UNTIL;      break;
+        case 'W':   tkn = T_WHILE;      break;
+        default:    return -1;
+        }
+        break;
+    case 6:
+        tkn = T_RETURN;
+        break;
+    case 7:
+        tkn = T_INCLUDE;
+        break;
+    case 8:
+        tkn = T_FUNCTION;
+        break;
+    default:
+        return -1;
+    }
+
+    /* check the rest of the keyword */
+    return strncasecmp(ktab[tkn - T_REM].keyword, name, len) == 0 ? tkn - T_REM : -1;
+}
+
+/* CrunchedToken - get the token for a crunched keyword byte (T_NONE if it isn't one) */
+int CrunchedToken(int ch)
+{
+    return ch >= KEYWORD_BYTE && ch < KEYWORD_BYTE + KEYWORD_COUNT ? T_REM + ch - KEYWORD_BYTE : T_NONE;
+}
+
+/* CrunchLine - replace the keywords in a line with keyword bytes (returns the length) */
+/* (strings, character constants and comments are left alone, *pInComment says whether the line */
+/* starts in a block comment and is updated for the next line, and keyword bytes already in the */
+/* line are kept so a stored line can be crunched again to find where its comments end) */
+int CrunchLine(const char *src, char *buf, int size, int *pInComment)
+{
+    char *dst = buf, *top = buf + size - 1;
+    int tkn;
+    src = CopyCommentRest(src, &dst, top, pInComment);
+    while (*src != '\0' && dst < top) {
+        if ((tkn = CrunchedToken((uint8_t)*src)) != T_NONE) {
+            *dst++ = *src++;
+            if (tkn == T_REM)
+                src = CopyLiteral(src, &dst, top, VMTRUE, pInComment);
+        }
+        else if (IdentifierCharP((uint8_t)*src)) {
+            const char *start = src;
+            int i;
+            while (*src != '\0' && IdentifierCharP((uint8_t)*src))
+                ++src;
+            if (!isdigit((uint8_t)*start) && (i = FindKeyword(start, src - start)) >= 0) {
+                *dst++ = KEYWORD_BYTE + i;
+                if (ktab[i].token == T_REM)
+                    src = CopyLiteral(src, &dst, top, VMTRUE, pInComment);
+            }
+            else {
+                while (start < src && dst < top)
+                    *dst++ = *start++;
+            }
+        }
+        else
+            src = CopyLiteral(src, &dst, top, VMFALSE, pInComment);
+    }
+    *dst = '\0';
+    return dst - buf;
+}
+
+/* ExpandLine - replace the keyword bytes in a crunched line with the keywords (returns the length) */
+/* (*pInComment tracks block comments across lines as in CrunchLine) */
+int ExpandLine(const char *src, char *buf, int size, int *pInComment)
+{
+    char *dst = buf, *top = buf + size - 1;
+    int tkn;
+    src = CopyCommentRest(src, &dst, top, pInComment);
+    while (*src != '\0' && dst < top) {
+        if ((tkn = CrunchedToken((uint8_t)*src)) != T_NONE) {
+            const char *p = ktab[(uint8_t)*src++ - KEYWORD_BYTE].keyword;
+            while (*p != '\0' && dst < top)
+                *dst++ = *p++;
+            if (tkn == T_REM)
+                src = CopyLiteral(src, &dst, top, VMTRUE, pInComment);
+        }
+        else
+            src = CopyLiteral(src, &dst, top, VMFALSE, pInComment);
+    }
+    *dst = '\0';
+    return dst - buf;
+}
+
+/* CopyCommentRest - copy the rest of a block comment continued from the previous line */
+static const char *CopyCommentRest(const char *src, char **pDst, char *top, int *pInComment)
+{
+    char *dst = *pDst;
+    const char *end;
+    
+    /* nothing to copy unless the line starts in a comment */
+    if (!*pInComment)
+        return src;
+        
+    /* find the end of the comment */
+    if ((end = strstr(src, "*/")) != NULL) {
+        end += 2;
+        *pInComment = VMFALSE;
+    }
+    else
+        end = src + strlen(src);
+        
+    /* copy it */
+    while (src < end && dst < top)
+        *dst++ = *src++;
+    *pDst = dst;
+    
+    return end;
+}
+
+/* CopyLiteral - copy a character, a string or character constant, a comment or the rest of the line */
+/* (*pInComment is set when a block comment isn't closed on this line) */
+static const char *CopyLiteral(const char *src, char **pDst, char *top, int restOfLine, int *pInComment)
+{
+    char *dst = *pDst;
+    const char *end;
+    
+    /* find the end of the text to copy unchanged */
+    if (restOfLine || (src[0] == '/' && src[1] == '/'))
+        end = src + strlen(src);
+    else if (*src == '"' || *src == '\'') {
+        for (end = src + 1; *end != '\0' && *end != *src; ++end)
+            if (*end == '\\' && end[1] != '\0')
+                ++end;
+        if (*end != '\0')
+            ++end;
+    }
+    else if (src[0] == '/' && src[1] == '*') {
+        if ((end = strstr(src + 2, "*/")) != NULL)
+            end += 2;
+        else {
+            end = src + strlen(src);
+            *pInComment = VMTRUE;
+        }
+    }
+    else
+        end = src + 1;
+        
+    /* copy it */
+    while (src < end && dst < top)
+        *dst++ = *src++;
+    *pDst = dst;
+    
+    return end;
+}
+
 /* IdentifierCharP - is this an identifier character? */
 static int IdentifierCharP(int ch)
 {
@@ -399,15 +651,30 @@ static int IdentifierCharP(int ch)
 }
 
 /* NumberToken - get a number */
+/* (the digits of a number and its terminator must fit in the token buffer) */
 static int NumberToken(ParseContext *c, int ch)
 {
     char *p = c->token;
+    int len = 1;
 
     /* get the number */
     *p++ = ch;
+    if (!c->inComment) {
+        const char *end = SpanClass(c->sys->linePtr, CLASS_DIGIT);
+        while (c->sys->linePtr < end) {
+            if ((ch = *c->sys->linePtr++) != '_') {
+                if (++len >= MAXTOKEN)
+                    ParseError(c, "Number too long");
+                *p++ = ch;
+            }
+        }
+    }
     while ((ch = GetChar(c)) != EOF) {
-        if (isdigit(ch))
+        if (isdigit(ch)) {
+            if (++len >= MAXTOKEN)
+                ParseError(c, "Number too long");
             *p++ = ch;
+        }
         else if (ch != '_')
             break;
     }
@@ -425,12 +692,15 @@ static int NumberToken(ParseContext *c, int ch)
 static int HexNumberToken(ParseContext *c)
 {
     char *p = c->token;
-    int ch;
+    int len = 0, ch;
 
     /* get the number */
     while ((ch = GetChar(c)) != EOF) {
-        if (isxdigit(ch))
+        if (isxdigit(ch)) {
+            if (++len >= MAXTOKEN)
+                ParseError(c, "Number too long");
             *p++ = ch;
+        }
         else if (ch != '_')
             break;
     }
@@ -448,12 +718,15 @@ static int HexNumberToken(ParseContext *c)
 static int BinaryNumberToken(ParseContext *c)
 {
     char *p = c->token;
-    int ch;
+    int len = 0, ch;
 
     /* get the number */
     while ((ch = GetChar(c)) != EOF) {
-        if (ch == '0' || ch == '1')
+        if (ch == '0' || ch == '1') {
+            if (++len >= MAXTOKEN)
+                ParseError(c, "Number too long");
             *p++ = ch;
+        }
         else if (ch != '_')
             break;
     }
@@ -527,23 +800,112 @@ static int LiteralChar(ParseContext *c)
 int SkipSpaces(ParseContext *c)
 {
     int ch;
-    while ((ch = GetChar(c)) != EOF)
-        if (!isspace(ch))
-            break;
+    do {
+        if (!c->inComment)
+            c->sys->linePtr = (char *)SpanClass(c->sys->linePtr, CLASS_SPACE);
+    } while ((ch = GetChar(c)) != EOF && isspace(ch));
     return ch;
 }
 
 /* SkipComment - skip characters up to the end of a comment */
 static int SkipComment(ParseContext *c)
 {
-    int lastch, ch;
-    lastch = '\0';
-    while ((ch = XGetC(c)) != EOF) {
-        if (lastch == '*' && ch == '/')
+    const char *p = c->sys->linePtr;
+    for (;;) {
+        p = SpanClass(p, CLASS_COMMENT);
+        if (*p == '\0') {
+            c->sys->linePtr = (char *)p;
+            return VMFALSE;
+        }
+        if (*++p == '/') {
+            c->sys->linePtr = (char *)p + 1;
             return VMTRUE;
-        lastch = ch;
+        }
+    }
+}
+
+#ifdef __SSE2__
+
+/* ClassMask - get a mask with a bit set for each byte of a block that is in a class */
+/* (bytes with the high bit set compare as negative so they are never in a class) */
+static int ClassMask(__m128i v, int cls)
+{
+    __m128i in;
+    switch (cls) {
+    case CLASS_SPACE:
+        in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                          _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                        _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1))));
+        break;
+    case CLASS_IDENTIFIER:
+    case CLASS_DIGIT:
+        in = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                        _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))),
+                          _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        if (cls == CLASS_IDENTIFIER) {
+            __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            in = _mm_or_si128(in, _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                                _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1))));
+            in = _mm_or_si128(in, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('$')),
+                                               _mm_cmpeq_epi8(v, _mm_set1_epi8('%'))));
+        }
+        break;
+    default:
+        in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')),
+                          _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        return ~_mm_movemask_epi8(in) & 0xffff;
+    }
+    return _mm_movemask_epi8(in);
+}
+
+/* SpanClass - find the first character that isn't in a class (the terminating '\0' never is) */
+/* (blocks are aligned so a load never crosses into the page after the terminator) */
+static const char *SpanClass(const char *p, int cls)
+{
+    const char *block;
+    int mask;
+    
+    /* most runs are too short to be worth loading a block */
+    if (!CharInClassP((uint8_t)p[0], cls))
+        return p;
+    if (!CharInClassP((uint8_t)p[1], cls))
+        return p + 1;
+    
+    /* find the end of the run a block at a time */
+    block = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    mask = ~ClassMask(_mm_load_si128((const __m128i *)block), cls) & (0xffff << (p - block)) & 0xffff;
+    while (mask == 0) {
+        block += 16;
+        mask = ~ClassMask(_mm_load_si128((const __m128i *)block), cls) & 0xffff;
+    }
+    return block + __builtin_ctz(mask);
+}
+
+#else
+
+/* SpanClass - find the first character that isn't in a class (the terminating '\0' never is) */
+static const char *SpanClass(const char *p, int cls)
+{
+    while (CharInClassP((uint8_t)*p, cls))
+        ++p;
+    return p;
+}
+
+#endif
+
+/* CharInClassP - is this character in a class? */
+static int CharInClassP(int ch, int cls)
+{
+    switch (cls) {
+    case CLASS_SPACE:
+        return ch != '\0' && isspace(ch);
+    case CLASS_IDENTIFIER:
+        return ch != '\0' && IdentifierCharP(ch);
+    case CLASS_DIGIT:
+        return isdigit(ch) || ch == '_';
+    default:
+        return ch != '\0' && ch != '*';
     }
-    return VMFALSE;
 }
 
 /* GetChar - get the next character */
@@ -599,7 +961,7 @@ static int XGetC(ParseContext *c)
     int ch;
     
     /* get the next character on the current line */
-    if (!(ch = *c->sys->linePtr++)) {
+    if (!(ch = (uint8_t)*c->sys->linePtr++)) {
         --c->sys->linePtr;
         return EOF;
     }
@@ -618,6 +980,8 @@ void UngetC(ParseContext *c)
 /* ParseError - report a parsing error */
 void ParseError(ParseContext *c, const char *fmt, ...)
 {
+    char line[MAXLINE], prefix[MAXLINE], *p;
+    int offset, inComment;
     va_list ap;
 
     /* print the error message */
@@ -627,10 +991,23 @@ void ParseError(ParseContext *c, const char *fmt, ...)
     VM_putchar('\n');
     va_end(ap);
 
-    /* show the context */
+    /* show the context with any crunched keywords expanded */
     VM_printf("  line %d\n", c->lineNumber);
-    VM_printf("    %s", c->sys->lineBuf);
-    VM_printf("    %*s^\n", c->tokenOffset, "");
+    /* (a line from a mapped file may be longer than the line buffer or VM_printf can handle) */
+    inComment = VMFALSE;
+    ExpandLine(c->sys->lineStart, line, sizeof(line), &inComment);
+    VM_printf("    ");
+    for (p = line; *p != '\0'; ++p)
+        VM_putchar(*p);
+    if (p == line || p[-1] != '\n')
+        VM_putchar('\n');
+    offset = c->tokenOffset < MAXLINE - 1 ? c->tokenOffset : MAXLINE - 1;
+    strncpy(prefix, c->sys->lineStart, offset);
+    prefix[offset] = '\0';
+    inComment = VMFALSE;
+    for (offset = ExpandLine(prefix, line, sizeof(line), &inComment) + 4; --offset >= 0; )
+        VM_putchar(' ');
+    VM_printf("^\n");
 
     /* exit until we fix the compiler so it can recover from parse errors */
     longjmp(c->sys->errorTarget, 1);
@@ -0,0 +1,444 @@
+/* server.c - compile and run programs for clients connected to a Unix domain socket
+ *
+ * Copyright (c) 2020 by David Michael Betz.  All rights reserved.
+ *
+ * The server stays resident with its system and workspace already set up and
+ * runs each job in a child process forked from it. Each job starts from the
+ * same clean heap and compiler state, and several jobs can run at once.
+ *
+ * Include files named when the server starts are compiled to object modules
+ * once, before any job is forked, and each child inherits them. A program that
+ * includes one of them links its object module instead of parsing the file
+ * again, as long as the file hasn't changed since the server compiled it.
+ *
+ * A client sends the directory that relative file names are relative to, then
+ * the name of a source or image file to run, each on its own line. A name of
+ * "-" means the source of the program follows. The client then shuts down its
+ * side of the connection. The server sends back the output of the job followed
+ * by a single byte with its exit status.
+ *
+ */
+
+#ifndef PROPELLER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "driver.h"
+
+#define MAXJOBS     16      /* jobs that can run at once */
+#define MAXMODULES  16      /* include files compiled when the server starts */
+
+/* nanoseconds of a file's modification time (a file can change more than once a second) */
+#ifdef __APPLE__
+#define MTIME_NSEC(st)  ((st)->st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st)  ((st)->st_mtim.tv_nsec)
+#endif
+
+/* include file compiled to an object module when the server starts */
+typedef struct {
+    char path[PATH_MAX];    /* full path of the file */
+    struct stat st;         /* file status when it was compiled */
+    uint8_t *object;        /* object module */
+} Module;
+
+/* include files compiled when the server starts */
+typedef struct {
+    Module modules[MAXMODULES];
+    int count;
+} ModuleTable;
+
+/* job running in a child process */
+typedef struct {
+    pid_t pid;              /* child process */
+    int client;             /* connection to the client */
+    int done;               /* end of a pipe that is closed when the child exits */
+} Job;
+
+/* source of a program sent by a client */
+typedef struct {
+    FILE *fp;               /* connection to the client */
+    int lineNumber;         /* number of the last line read */
+} ClientSource;
+
+/* local function prototypes */
+static int CompileModules(System *sys, ModuleTable *table, char **includes, int includeCount);
+static uint8_t *FindModule(void *cookie, const char *name);
+static int SameFile(const struct stat *a, const struct stat *b);
+static int OpenServerSocket(const char *path);
+static int ConnectToServer(const char *path);
+static void StartJob(System *sys, Job *jobs, int jobCount, int listener, int client);
+static void RunJob(System *sys, int client);
+static void FinishJob(Job *job);
+static char *GetClientLine(char *buf, int len, int *pLineNumber, void *cookie);
+static char *ReadRequestLine(FILE *fp, char *buf, int size);
+static int WriteAll(int fd, const char *buf, size_t size);
+
+/* RunServer - run jobs for clients until the server is killed */
+int RunServer(System *sys, const char *path, char **includes, int includeCount)
+{
+    struct pollfd fds[MAXJOBS + 1];
+    ModuleTable modules;
+    Job jobs[MAXJOBS];
+    int listener, client, jobCount = 0, i;
+
+    /* compile the include files the jobs will share */
+    if (!CompileModules(sys, &modules, includes, includeCount))
+        return VMFALSE;
+    sys->findObject = FindModule;
+    sys->findObjectCookie = &modules;
+
+    if ((listener = OpenServerSocket(path)) < 0)
+        return VMFALSE;
+
+    /* a client that goes away only ends its own job */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+
+        /* wait for a job to finish or, if there is room for another, a client to connect */
+        for (i = 0; i < jobCount; ++i) {
+            fds[i].fd = jobs[i].done;
+            fds[i].events = POLLIN;
+        }
+        fds[jobCount].fd = listener;
+        fds[jobCount].events = POLLIN;
+        if (poll(fds, jobCount < MAXJOBS ? jobCount + 1 : jobCount, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        /* report the status of finished jobs (from the end so removing one doesn't skip another) */
+        for (i = jobCount; --i >= 0; ) {
+            if (fds[i].revents) {
+                FinishJob(&jobs[i]);
+                jobs[i] = jobs[--jobCount];
+            }
+        }
+
+        /* start a job for a new client */
+        if (jobCount < MAXJOBS && fds[jobCount].fd == listener && (fds[jobCount].revents & POLLIN)) {
+            if ((client = accept(listener, NULL, NULL)) >= 0) {
+                StartJob(sys, jobs, jobCount, listener, client);
+                if (jobs[jobCount].pid > 0)
+                    ++jobCount;
+            }
+        }
+    }
+
+    close(listener);
+    return VMFALSE;
+}
+
+/* SubmitJob - have a server run a source or image file (or the source on stdin if the name is "-") */
+/* (returns the exit status of the job) */
+int SubmitJob(const char *path, const char *name)
+{
+    char buf[BUFSIZ], cwd[FILENAME_MAX];
+    int server, last = -1, cnt, n;
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd");
+        return 1;
+    }
+    if ((server = ConnectToServer(path)) < 0)
+        return 1;
+
+    /* send the request and, if it isn't in a file, the source of the program */
+    if (!WriteAll(server, cwd, strlen(cwd)) || !WriteAll(server, "\n", 1)
+    ||  !WriteAll(server, name, strlen(name)) || !WriteAll(server, "\n", 1)) {
+        perror("sending request");
+        close(server);
+        return 1;
+    }
+    if (strcmp(name, "-") == 0) {
+        while ((cnt = read(0, buf, sizeof(buf))) > 0) {
+            if (!WriteAll(server, buf, cnt)) {
+                perror("sending source");
+                close(server);
+                return 1;
+            }
+        }
+    }
+    shutdown(server, SHUT_WR);
+
+    /* copy the output of the job holding back the last byte since it is the exit status */
+    while ((cnt = read(server, buf, sizeof(buf))) > 0) {
+        if (last >= 0)
+            putchar(last);
+        for (n = 0; n < cnt - 1; ++n)
+            putchar(buf[n]);
+        last = (uint8_t)buf[cnt - 1];
+    }
+    fflush(stdout);
+    close(server);
+
+    if (last < 0) {
+        fprintf(stderr, "error: the server closed the connection\n");
+        return 1;
+    }
+    return last;
+}
+
+/* CompileModules - compile include files to object modules that jobs link instead of parsing the files */
+static int CompileModules(System *sys, ModuleTable *table, char **includes, int includeCount)
+{
+    Module *module;
+    int i;
+
+    if (includeCount > MAXMODULES) {
+        fprintf(stderr, "error: too many include files (at most %d)\n", MAXMODULES);
+        return VMFALSE;
+    }
+
+    for (i = 0; i < includeCount; ++i) {
+        module = &table->modules[i];
+        if (!realpath(includes[i], module->path) || stat(module->path, &module->st) < 0) {
+            perror(includes[i]);
+            return VMFALSE;
+        }
+        if (!(module->object = BuildModule(sys, module->path))) {
+            fprintf(stderr, "error: can't compile '%s' to an object module\n", includes[i]);
+            return VMFALSE;
+        }
+    }
+    table->count = includeCount;
+
+    return VMTRUE;
+}
+
+/* FindModule - find the object module compiled from an include file if the file hasn't changed */
+static uint8_t *FindModule(void *cookie, const char *name)
+{
+    ModuleTable *table = (ModuleTable *)cookie;
+    char path[PATH_MAX];
+    struct stat st;
+    int i;
+
+    if (table->count == 0 || !realpath(name, path) || stat(path, &st) < 0)
+        return NULL;
+    for (i = 0; i < table->count; ++i) {
+        Module *module = &table->modules[i];
+        if (strcmp(path, module->path) == 0 && SameFile(&st, &module->st))
+            return module->object;
+    }
+    return NULL;
+}
+
+/* SameFile - check whether two file statuses are for the same unchanged file */
+static int SameFile(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev
+        && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtime == b->st_mtime
+        && MTIME_NSEC(a) == MTIME_NSEC(b);
+}
+
+/* OpenServerSocket - create the socket clients connect to */
+static int OpenServerSocket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path too long: %s\n", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* replace a socket left behind by a server that is no longer running */
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "error: a server is already running on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* ConnectToServer - connect to the socket of a server */
+static int ConnectToServer(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path too long: %s\n", path);
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* StartJob - start a child process to run the job for a client */
+/* (the new job is added after the jobs that are already running unless it can't be started) */
+static void StartJob(System *sys, Job *jobs, int jobCount, int listener, int client)
+{
+    Job *job = &jobs[jobCount];
+    int done[2], i;
+
+    job->pid = -1;
+    if (pipe(done) < 0) {
+        perror("pipe");
+        close(client);
+        return;
+    }
+
+    VM_flush();
+    if ((job->pid = fork()) == 0) {
+
+        /* the child only keeps the connection to its own client and the pipe that tells the server it's done */
+        close(listener);
+        close(done[0]);
+        for (i = 0; i < jobCount; ++i) {
+            close(jobs[i].client);
+            close(jobs[i].done);
+        }
+        signal(SIGPIPE, SIG_DFL);
+
+        RunJob(sys, client);
+    }
+
+    close(done[1]);
+    if (job->pid < 0) {
+        perror("fork");
+        close(done[0]);
+        close(client);
+        return;
+    }
+    job->client = client;
+    job->done = done[0];
+}
+
+/* RunJob - run the job for a client in a child process */
+static void RunJob(System *sys, int client)
+{
+    char cwd[FILENAME_MAX], name[FILENAME_MAX];
+    ClientSource source;
+    FILE *fp;
+    int sts;
+
+    /* the output of the job goes to the client */
+    dup2(client, STDOUT_FILENO);
+    dup2(client, STDERR_FILENO);
+
+    /* get the request */
+    if (!(fp = fdopen(client, "r"))
+    ||  !ReadRequestLine(fp, cwd, sizeof(cwd))
+    ||  !ReadRequestLine(fp, name, sizeof(name))) {
+        VM_printf("error: bad request\n");
+        VM_flush();
+        _exit(1);
+    }
+    if (chdir(cwd) < 0) {
+        VM_printf("error: can't change to '%s'\n", cwd);
+        VM_flush();
+        _exit(1);
+    }
+
+    /* run the program */
+    if (strcmp(name, "-") == 0) {
+        source.fp = fp;
+        source.lineNumber = 0;
+        sts = RunSource(sys, GetClientLine, &source);
+    }
+    else
+        sts = RunFile(sys, name);
+
+    VM_flush();
+    _exit(sts ? 0 : 1);
+}
+
+/* FinishJob - send the exit status of a job to its client */
+static void FinishJob(Job *job)
+{
+    uint8_t code = 1;
+    int status;
+
+    if (waitpid(job->pid, &status, 0) == job->pid && WIFEXITED(status))
+        code = WEXITSTATUS(status);
+    WriteAll(job->client, (char *)&code, 1);
+    close(job->client);
+    close(job->done);
+}
+
+/* GetClientLine - get a line of the source of a program sent by a client */
+static char *GetClientLine(char *buf, int len, int *pLineNumber, void *cookie)
+{
+    ClientSource *source = (ClientSource *)cookie;
+    if (!fgets(buf, len, source->fp))
+        return NULL;
+    *pLineNumber = ++source->lineNumber;
+    return buf;
+}
+
+/* ReadRequestLine - read a line of a request without its newline */
+static char *ReadRequestLine(FILE *fp, char *buf, int size)
+{
+    size_t len;
+    if (!fgets(buf, size, fp) || (len = strlen(buf)) == 0 || buf[len - 1] != '\n')
+        return NULL;
+    buf[len - 1] = '\0';
+    return buf;
+}
+
+/* WriteAll - write all of a buffer to a file descriptor */
+static int WriteAll(int fd, const char *buf, size_t size)
+{
+    ssize_t cnt;
+    while (size > 0) {
+        if ((cnt = write(fd, buf, size)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return VMFALSE;
+        }
+        buf += cnt;
+        size -= cnt;
+    }
+    return VMTRUE;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "system.h"
+
+/* server.c */
+int RunServer(System *sys, const char *path, char **includes, int includeCount);
+int SubmitJob(const char *path, const char *name);
+
+#endif
@@ -11,16 +11,31 @@
 
 /* local function prototypes */
 static Symbol *AddLocalSymbol(ParseContext *c, SymbolTable *table, const char *name, StorageClass storageClass, Type *type, VMVALUE value);
-static Symbol *FindSymbol(SymbolTable *table, const char *name);
+static void AddSymbol(SymbolTable *table, Symbol *sym);
+static Symbol *FindSymbol(SymbolTable *table, const char *name, SymbolHash hash);
 
 /* InitSymbolTable - initialize a symbol table */
-void InitSymbolTable(SymbolTable *table)
+/* (the hash chains are allocated with the table so they are released along with it) */
+void InitSymbolTable(ParseContext *c, SymbolTable *table, int bucketCount)
 {
     table->head = NULL;
     table->pTail = &table->head;
+    table->buckets = (Symbol **)AllocateHighMemory(c->sys, bucketCount * sizeof(Symbol *), HEAP_SYMBOLS);
+    memset(table->buckets, 0, bucketCount * sizeof(Symbol *));
+    table->bucketMask = bucketCount - 1;
     table->count = 0;
 }
 
+/* HashName - compute the case-folded hash of a symbol name */
+/* (the scanner computes the same hash for each identifier as it reads it) */
+SymbolHash HashName(const char *name)
+{
+    SymbolHash hash = NAMEHASH_INIT;
+    while (*name != '\0')
+        hash = NameHashStep(hash, *name++);
+    return hash;
+}
+
 /* AddGlobal - add a global symbol to the symbol table */
 Symbol *AddGlobal(ParseContext *c, const char *name, StorageClass storageClass, Type *type, VMVALUE value)
 {
@@ -28,17 +43,17 @@ Symbol *AddGlobal(ParseContext *c, const char *name, StorageClass storageClass,
     Symbol *sym;
     
     /* allocate the symbol structure */
-    sym = (Symbol *)AllocateLowMemory(c->sys, size);
+    sym = (Symbol *)AllocateLowMemory(c->sys, size, HEAP_SYMBOLS);
     strcpy(sym->name, name);
+    sym->hash = HashName(name);
     sym->placed = VMFALSE;
     sym->storageClass = storageClass;
+    sym->type = type;
     sym->value = value;
-    sym->next = NULL;
+    sym->definition = 0;
 
     /* add it to the symbol table */
-    *c->globals.pTail = sym;
-    c->globals.pTail = &sym->next;
-    ++c->globals.count;
+    AddSymbol(&c->globals, sym);
     
     /* return the symbol */
     return sym;
@@ -63,49 +78,60 @@ static Symbol *AddLocalSymbol(ParseContext *c, SymbolTable *table, const char *n
     Symbol *sym;
     
     /* allocate the symbol structure */
-    sym = (Symbol *)AllocateHighMemory(c->sys, size);
+    sym = (Symbol *)AllocateHighMemory(c->sys, size, HEAP_SYMBOLS);
     strcpy(sym->name, name);
+    sym->hash = HashName(name);
     sym->placed = VMTRUE;
     sym->storageClass = storageClass;
     sym->type = type;
     sym->value = value;
-    sym->next = NULL;
+    sym->definition = 0;
 
     /* add it to the symbol table */
-    *table->pTail = sym;
-    table->pTail = &sym->next;
-    ++table->count;
+    AddSymbol(table, sym);
     
     /* return the symbol */
     return sym;
 }
 
+/* AddSymbol - add a symbol to the end of a symbol table and to its hash chain */
+static void AddSymbol(SymbolTable *table, Symbol *sym)
+{
+    Symbol **pBucket = &table->buckets[sym->hash & table->bucketMask];
+    sym->next = NULL;
+    *table->pTail = sym;
+    table->pTail = &sym->next;
+    sym->hashNext = *pBucket;
+    *pBucket = sym;
+    ++table->count;
+}
+
 /* FindGlobal - find a global symbol */
-Symbol *FindGlobal(ParseContext *c, const char *name)
+Symbol *FindGlobal(ParseContext *c, const char *name, SymbolHash hash)
 {
-    return FindSymbol(&c->globals, name);
+    return FindSymbol(&c->globals, name, hash);
 }
 
 /* FindArgument - find an argument symbol */
-Symbol *FindArgument(ParseContext *c, const char *name)
+Symbol *FindArgument(ParseContext *c, const char *name, SymbolHash hash)
 {
-    return FindSymbol(&c->currentFunction->u.functionDefinition.arguments, name);
+    return FindSymbol(&c->currentFunction->u.functionDefinition.arguments, name, hash);
 }
 
 /* FindLocal - find an local symbol */
-Symbol *FindLocal(ParseContext *c, const char *name)
+Symbol *FindLocal(ParseContext *c, const char *name, SymbolHash hash)
 {
-    return FindSymbol(&c->currentFunction->u.functionDefinition.locals, name);
+    return FindSymbol(&c->currentFunction->u.functionDefinition.locals, name, hash);
 }
 
-/* FindSymbol - find a symbol in a symbol table */
-static Symbol *FindSymbol(SymbolTable *table, const char *name)
+/* FindSymbol - find a symbol in a symbol table using the hash of its name */
+static Symbol *FindSymbol(SymbolTable *table, const char *name, SymbolHash hash)
 {
-    Symbol *sym = table->head;
+    Symbol *sym = table->buckets[hash & table->bucketMask];
     while (sym) {
-        if (strcasecmp(name, sym->name) == 0)
+        if (sym->hash == hash && strcasecmp(name, sym->name) == 0)
             return sym;
-        sym = sym->next;
+        sym = sym->hashNext;
     }
     return NULL;
 }
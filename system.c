@@ -6,8 +6,33 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include "system.h"
 
+/* local function prototypes */
+static void UpdateHeapUsage(System *sys, HeapOwner owner);
+
+/* heap owner names for ReportHeapUsage */
+static char *heapOwnerNames[] = {
+    "parse tree",
+    "node lists",
+    "symbols",
+    "strings",
+    "code",
+    "data",
+    "vm stack",
+    "edit buffer",
+    "compiler"
+};
+
+/* phase names for ReportTiming */
+static char *phaseNames[] = {
+    "parse",
+    "generate",
+    "link",
+    "execute"
+};
+
 /* InitSystem - initialize the compiler */
 System *InitSystem(uint8_t *freeSpace, size_t freeSize)
 {
@@ -20,32 +45,131 @@ System *InitSystem(uint8_t *freeSpace, size_t freeSize)
     sys->nextHigh = sys->freeTop;
     sys->heapSize = sys->freeTop - sys->freeSpace;
     sys->maxHeapUsed = 0;
+    sys->imageBufferSize = IMAGESIZE;
+    memset(sys->lowUsed, 0, sizeof(sys->lowUsed));
+    memset(sys->highUsed, 0, sizeof(sys->highUsed));
+    memset(sys->maxUsed, 0, sizeof(sys->maxUsed));
+    sys->compileFunction = NULL;
+    sys->compileFunctionCookie = NULL;
+    sys->findObject = NULL;
+    sys->findObjectCookie = NULL;
+    sys->diagnostics = DIAG_DUMP;
+    StartTiming(sys);
     return sys;
 }
 
 /* AllocateHighMemory - allocate high memory from the heap */
-void *AllocateHighMemory(System *sys, size_t size)
+void *AllocateHighMemory(System *sys, size_t size, HeapOwner owner)
 {
     size = (size + ALIGN_MASK) & ~ALIGN_MASK;
     if (sys->nextHigh - size < sys->nextLow)
         Abort(sys, "insufficient memory");
     sys->nextHigh -= size;
-    if (sys->heapSize - (sys->nextHigh - sys->nextLow) > sys->maxHeapUsed)
-        sys->maxHeapUsed = sys->heapSize - (sys->nextHigh - sys->nextLow);
+    sys->highUsed[owner] += size;
+    UpdateHeapUsage(sys, owner);
     return sys->nextHigh;
 }
 
 /* AllocateLowMemory - allocate low memory from the heap */
-void *AllocateLowMemory(System *sys, size_t size)
+void *AllocateLowMemory(System *sys, size_t size, HeapOwner owner)
 {
     uint8_t *p = sys->nextLow;
     size = (size + ALIGN_MASK) & ~ALIGN_MASK;
     if (p + size > sys->nextHigh)
         Abort(sys, "insufficient memory");
     sys->nextLow += size;
+    sys->lowUsed[owner] += size;
+    UpdateHeapUsage(sys, owner);
+    return p;
+}
+
+/* MarkHeap - remember the current heap position and usage */
+void MarkHeap(System *sys, HeapMark *mark)
+{
+    mark->nextLow = sys->nextLow;
+    mark->nextHigh = sys->nextHigh;
+    memcpy(mark->lowUsed, sys->lowUsed, sizeof(sys->lowUsed));
+    memcpy(mark->highUsed, sys->highUsed, sizeof(sys->highUsed));
+}
+
+/* ReleaseHighMemory - release the high memory allocated since a mark */
+void ReleaseHighMemory(System *sys, HeapMark *mark)
+{
+    sys->nextHigh = mark->nextHigh;
+    memcpy(sys->highUsed, mark->highUsed, sizeof(sys->highUsed));
+}
+
+/* ReleaseLowMemory - release the low memory allocated since a mark */
+void ReleaseLowMemory(System *sys, HeapMark *mark)
+{
+    sys->nextLow = mark->nextLow;
+    memcpy(sys->lowUsed, mark->lowUsed, sizeof(sys->lowUsed));
+}
+
+/* ReportHeapUsage - show the current and maximum heap usage of each owner */
+void ReportHeapUsage(System *sys, const char *when)
+{
+    Phase previous = EnterPhase(sys, PHASE_DIAGNOSTICS);
+    size_t used, total = 0;
+    int owner;
+    VM_printf("Heap usage %s:\n", when);
+    VM_printf("  %-12s %10s %10s\n", "owner", "current", "peak");
+    for (owner = 0; owner < HEAP_OWNER_COUNT; ++owner) {
+        used = sys->lowUsed[owner] + sys->highUsed[owner];
+        VM_printf("  %-12s %10lu %10lu\n", heapOwnerNames[owner], (unsigned long)used, (unsigned long)sys->maxUsed[owner]);
+        total += used;
+    }
+    VM_printf("  %-12s %10lu %10lu\n", "total", (unsigned long)total, (unsigned long)sys->maxHeapUsed);
+    VM_printf("  %-12s %10lu\n", "heap size", (unsigned long)sys->heapSize);
+    EnterPhase(sys, previous);
+}
+
+/* StartTiming - clear the phase times and start timing the parse phase */
+void StartTiming(System *sys)
+{
+    memset(sys->phaseTime, 0, sizeof(sys->phaseTime));
+    sys->phase = PHASE_PARSE;
+    sys->phaseStart = VM_ticks();
+}
+
+/* EnterPhase - charge the time so far to the current phase and start timing another */
+/* (returns the phase that was being timed so a nested phase can return to it) */
+Phase EnterPhase(System *sys, Phase phase)
+{
+    uint32_t now = VM_ticks();
+    Phase previous = sys->phase;
+    if (previous != PHASE_DIAGNOSTICS)
+        sys->phaseTime[previous] += now - sys->phaseStart;
+    sys->phaseStart = now;
+    sys->phase = phase;
+    return previous;
+}
+
+/* ReportTiming - show the time spent in each phase so far */
+/* (the time spent printing the report isn't charged to the phase being timed) */
+void ReportTiming(System *sys, const char *when)
+{
+    Phase previous = EnterPhase(sys, PHASE_DIAGNOSTICS);
+    uint32_t total = 0;
+    int phase;
+    VM_printf("Timing %s:\n", when);
+    VM_printf("  %-12s %10s\n", "phase", "usec");
+    for (phase = 0; phase < PHASE_COUNT; ++phase) {
+        VM_printf("  %-12s %10lu\n", phaseNames[phase], (unsigned long)sys->phaseTime[phase]);
+        total += sys->phaseTime[phase];
+    }
+    VM_printf("  %-12s %10lu\n", "total", (unsigned long)total);
+    EnterPhase(sys, previous);
+}
+
+/* UpdateHeapUsage - update the maximum heap usage after an allocation */
+static void UpdateHeapUsage(System *sys, HeapOwner owner)
+{
+    size_t used = sys->lowUsed[owner] + sys->highUsed[owner];
+    if (used > sys->maxUsed[owner])
+        sys->maxUsed[owner] = used;
     if (sys->heapSize - (sys->nextHigh - sys->nextLow) > sys->maxHeapUsed)
         sys->maxHeapUsed = sys->heapSize - (sys->nextHigh - sys->nextLow);
-    return p;
 }
 
 /* GetMainSource - get the main source */
@@ -67,7 +191,7 @@ int GetLine(System *sys, int *pLineNumber)
 {
     if (!(*sys->getLine)(sys->lineBuf, sizeof(sys->lineBuf) - 1, pLineNumber, sys->getLineCookie))
         return VMFALSE;
-    sys->linePtr = sys->lineBuf;
+    sys->lineStart = sys->linePtr = sys->lineBuf;
     return VMTRUE;
 }
 
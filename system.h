@@ -20,12 +20,53 @@ typedef struct System System;
 /* line input handler */
 typedef char *GetLineHandler(char *buf, int len, int *pLineNumber, void *cookie);
 
-/* code generator context */
+/* handler to compile a function of a running program (returns the code offset or zero on failure) */
+typedef VMVALUE CompileFunctionHandler(void *cookie, VMVALUE index);
+
+/* handler to find an object module compiled ahead of time from an include file (returns NULL if there isn't one) */
+typedef uint8_t *FindObjectHandler(void *cookie, const char *name);
+
+/* owners of heap space (for memory accounting) */
+typedef enum {
+    HEAP_NODES,                     /* parse tree nodes */
+    HEAP_NODE_LISTS,                /* parse tree node list entries */
+    HEAP_SYMBOLS,                   /* symbols */
+    HEAP_STRINGS,                   /* string constants */
+    HEAP_CODE,                      /* image buffer and code generator tables */
+    HEAP_DATA,                      /* data blocks and bss */
+    HEAP_STACK,                     /* interpreter and its stack */
+    HEAP_EDIT_BUFFER,               /* edit buffer */
+    HEAP_COMPILER,                  /* other compiler data structures */
+    HEAP_OWNER_COUNT
+} HeapOwner;
+
+/* diagnostics levels */
+typedef enum {
+    DIAG_QUIET,                     /* only errors and program output */
+    DIAG_TIMING,                    /* also the time spent in each phase */
+    DIAG_DUMP                       /* also the code, symbols, strings and heap usage */
+} DiagnosticsLevel;
+
+/* phases timed for diagnostics */
+typedef enum {
+    PHASE_PARSE,                    /* scanning and parsing */
+    PHASE_GENERATE,                 /* code generation */
+    PHASE_LINK,                     /* linking object modules, placing strings and data and fixups */
+    PHASE_EXECUTE,                  /* running the program */
+    PHASE_COUNT,
+    PHASE_DIAGNOSTICS = PHASE_COUNT /* printing diagnostics (not timed) */
+} Phase;
+
+/* heap position and usage to return to */
+typedef struct {
+    uint8_t *nextLow;
+    uint8_t *nextHigh;
+    size_t lowUsed[HEAP_OWNER_COUNT];
+    size_t highUsed[HEAP_OWNER_COUNT];
+} HeapMark;
+
+/* code generator context (defined in compile.h) */
 typedef struct GenerateContext GenerateContext;
-struct GenerateContext {
-    System *sys;
-    uint8_t *codeBuf;
-};
 
 /* system context */
 struct System {
@@ -37,15 +78,35 @@ struct System {
     uint8_t *nextLow;               /* next low memory heap space location */
     size_t heapSize;                /* size of heap space in bytes */
     size_t maxHeapUsed;             /* maximum amount of heap space allocated so far */
+    size_t imageBufferSize;         /* size of the image buffer allocated by the compiler */
+    size_t lowUsed[HEAP_OWNER_COUNT];   /* low memory in use by each owner */
+    size_t highUsed[HEAP_OWNER_COUNT];  /* high memory in use by each owner */
+    size_t maxUsed[HEAP_OWNER_COUNT];   /* maximum memory in use by each owner */
+    DiagnosticsLevel diagnostics;   /* diagnostic output to show */
+    Phase phase;                    /* phase currently being timed */
+    uint32_t phaseStart;            /* VM_ticks when the current phase was entered */
+    uint32_t phaseTime[PHASE_COUNT];    /* microseconds spent in each phase */
     GetLineHandler *getLine;        /* function to get a line from the source program */
     void *getLineCookie;            /* cookie for the rewind and getLine functions */
+    CompileFunctionHandler *compileFunction; /* function to compile a lazily compiled function */
+    void *compileFunctionCookie;    /* cookie for the compileFunction function */
+    FindObjectHandler *findObject;  /* function to find an object module compiled from an include file */
+    void *findObjectCookie;         /* cookie for the findObject function */
     char lineBuf[MAXLINE];          /* current input line */
+    char *lineStart;                /* start of the current line (in lineBuf or a mapped source file) */
     char *linePtr;                  /* pointer to the current character */
 };
 
 System *InitSystem(uint8_t *freeSpace, size_t freeSize);
-void *AllocateHighMemory(System *sys, size_t size);
-void *AllocateLowMemory(System *sys, size_t size);
+void *AllocateHighMemory(System *sys, size_t size, HeapOwner owner);
+void *AllocateLowMemory(System *sys, size_t size, HeapOwner owner);
+void MarkHeap(System *sys, HeapMark *mark);
+void ReleaseHighMemory(System *sys, HeapMark *mark);
+void ReleaseLowMemory(System *sys, HeapMark *mark);
+void ReportHeapUsage(System *sys, const char *when);
+void StartTiming(System *sys);
+Phase EnterPhase(System *sys, Phase phase);
+void ReportTiming(System *sys, const char *when);
 
 void GetMainSource(System *sys, GetLineHandler **pGetLine, void **pGetLineCookie);
 void SetMainSource(System *sys, GetLineHandler *getLine, void *getLineCookie);
@@ -58,11 +119,18 @@ void VM_printf(const char *fmt, ...);
 void VM_vprintf(const char *fmt, va_list ap);
 void VM_putchar(int ch);
 void VM_flush(void);
+uint32_t VM_ticks(void);
 
 void *VM_open(System *sys, const char *name, const char *mode);
 char *VM_getline(char *buf, int size, void *fp);
 void VM_close(void *fp);
 
+uint8_t *VM_mapimage(System *sys, const char *name, size_t imageSize, size_t totalSize);
+void VM_unmapimage(uint8_t *image, size_t totalSize);
+char *VM_mapsource(const char *name, size_t *pSize);
+void VM_unmapsource(char *text, size_t size);
+int VM_mkdir(const char *name);
+
 #ifdef LOAD_SAVE
 int VM_opendir(const char *path, VMDIR *dir);
 int VM_readdir(VMDIR *dir, VMDIRENT *entry);
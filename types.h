@@ -21,7 +21,20 @@
 
 /* size of image buffer (allocated from system heap) */
 #ifndef IMAGESIZE
-#define IMAGESIZE           2500
+#define IMAGESIZE           (16 * 1024)
+#endif
+
+/* default workspace size and image buffer size on hosts that reserve the workspace on demand */
+#ifndef WORKSPACESIZE
+#define WORKSPACESIZE       (64 * 1024 * 1024)
+#endif
+#ifndef HOSTIMAGESIZE
+#define HOSTIMAGESIZE       (1024 * 1024)
+#endif
+
+/* compile cache directory */
+#ifndef CACHE_DIR
+#define CACHE_DIR           ".jbcache"
 #endif
 
 /* edit buffer size (separate from the system heap) */
@@ -57,6 +70,7 @@ typedef uint32_t VMUVALUE;
 #define VMINTRINSIC(i)          Intrinsics[i]
 
 #define ANSI_FILE_IO
+#define COMPILE_CACHE
 
 /*********/
 /* LINUX */
@@ -78,6 +92,7 @@ typedef uint64_t VMUVALUE;
 #define VMINTRINSIC(i)          Intrinsics[i]
 
 #define ANSI_FILE_IO
+#define COMPILE_CACHE
 
 /*************/
 /* PROPELLER */
@@ -126,6 +141,10 @@ typedef FILE VMFILE;
 #define VM_fclose	fclose
 #define VM_fgets	fgets
 #define VM_fputs	fputs
+#define VM_fread	fread
+#define VM_fwrite	fwrite
+#define VM_remove	remove
+#define VM_rename	rename
 
 typedef struct {
     DIR *dirp;
@@ -37,6 +37,7 @@ OTDEF OpcodeTable[] = {
 { OP_GT,        "GT",       FMT_NONE    },
 { OP_LIT,       "LIT",      FMT_WORD    },
 { OP_SLIT,      "SLIT",     FMT_SBYTE   },
+{ OP_KLIT,      "KLIT",     FMT_BYTE    },
 { OP_LOAD,      "LOAD",     FMT_NONE    },
 { OP_LOADB,     "LOADB",    FMT_NONE    },
 { OP_STORE,     "STORE",    FMT_NONE    },
@@ -15,36 +15,92 @@
 #include "system.h"
 
 /* prototypes for local functions */
+static int Interpret(Interpreter *i);
 static void DoTrap(Interpreter *i, int op);
 
 /* InitInterpreter - initialize the interpreter */
-Interpreter *InitInterpreter(System *sys, uint8_t *base, int stackSize)
+Interpreter *InitInterpreter(System *sys, uint8_t *image, int stackSize)
 {
+    ImageHdr *hdr = (ImageHdr *)image;
     Interpreter *i;
     
-    if (!(i = (Interpreter *)AllocateLowMemory(sys, sizeof(Interpreter))))
+    if (!(i = (Interpreter *)AllocateLowMemory(sys, sizeof(Interpreter), HEAP_STACK)))
         return NULL;
         
-    if (!(i->stack = (VMVALUE *)AllocateLowMemory(sys, stackSize * sizeof(VMVALUE))))
+    if (!(i->stack = (VMVALUE *)AllocateLowMemory(sys, stackSize * sizeof(VMVALUE), HEAP_STACK)))
         return NULL;
         
-    i->base = base;
+    i->sys = sys;
+    i->base = image;
+    i->constants = (VMVALUE *)(image + hdr->constantsOffset);
     i->stackTop = i->stack + stackSize;
     
     return i;
 }
 
+/* RunImage - run the main code of a loaded image */
+int RunImage(System *sys, uint8_t *image, int stackSize)
+{
+    ImageHdr *hdr = (ImageHdr *)image;
+    Interpreter *i;
+    int result;
+    
+    /* setup an error target */
+    if (setjmp(sys->errorTarget) != 0)
+        return VMFALSE;
+        
+    if (!(i = InitInterpreter(sys, image, stackSize))) {
+        VM_printf("insufficient memory");
+        return VMFALSE;
+    }
+    
+    EnterPhase(sys, PHASE_EXECUTE);
+    result = Execute(i, hdr->entry);
+    if (sys->diagnostics >= DIAG_DUMP)
+        ReportHeapUsage(sys, "after run");
+    if (sys->diagnostics >= DIAG_TIMING)
+        ReportTiming(sys, "after run");
+    
+    return result;
+}
+
 /* Execute - execute the main code */
 int Execute(Interpreter *i, VMVALUE mainCode)
+{
+    i->pc = i->base + mainCode;
+    i->sp = i->fp = i->stackTop;
+    return Interpret(i);
+}
+
+/* CallFunction - call a function with arguments and get the value it returns */
+/* (the function returns to offset zero, the image header, which returns to the caller) */
+int CallFunction(Interpreter *i, VMVALUE code, int argc, const VMVALUE *argv, VMVALUE *pResult)
+{
+    /* push the arguments so the first one is on top like OP_CALL leaves them */
+    i->sp = i->fp = i->stackTop;
+    if (argc >= i->stackTop - i->stack) {
+        VM_printf("abort: stack overflow\n");
+        return VMFALSE;
+    }
+    while (--argc >= 0)
+        Push(i, argv[argc]);
+    i->tos = 0;
+    
+    /* run the function */
+    i->pc = i->base + code;
+    if (!Interpret(i))
+        return VMFALSE;
+    *pResult = i->tos;
+    return VMTRUE;
+}
+
+/* Interpret - execute code starting at the current pc */
+static int Interpret(Interpreter *i)
 {
     VMVALUE tmp;
     int8_t tmpb;
     int cnt;
 
-    /* initialize */    
-    i->pc = i->base + mainCode;
-    i->sp = i->fp = i->stackTop;
-
     if (setjmp(i->errorTarget))
         return VMFALSE;
 
@@ -175,6 +231,11 @@ int Execute(Interpreter *i, VMVALUE mainCode)
             CPush(i, i->tos);
             i->tos = tmpb;
             break;
+        case OP_KLIT:
+            tmp = i->constants[VMCODEBYTE(i->pc++)];
+            CPush(i, i->tos);
+            i->tos = tmp;
+            break;
         case OP_LOAD:
             i->tos = *(VMVALUE *)(i->base + i->tos);
             break;
@@ -226,6 +287,8 @@ int Execute(Interpreter *i, VMVALUE mainCode)
             i->tos = 0;
             // fall through
         case OP_RETURN:
+            if (Top(i) == 0)
+                return VMTRUE;
             i->pc = (uint8_t *)i->base + Top(i);
             i->sp = i->fp;
             i->fp = (VMVALUE *)(i->stack + i->fp[F_FP]);
@@ -252,6 +315,8 @@ int Execute(Interpreter *i, VMVALUE mainCode)
 
 static void DoTrap(Interpreter *i, int op)
 {
+    const char *str;
+    VMVALUE tmp;
     switch (op) {
     case TRAP_GetChar:
         Push(i, i->tos);
@@ -262,7 +327,9 @@ static void DoTrap(Interpreter *i, int op)
         i->tos = Pop(i);
         break;
     case TRAP_PrintStr:
-        VM_printf("%s", (char *)(i->base + i->tos));
+        /* (strings may be longer than a VM_printf buffer) */
+        for (str = (char *)(i->base + i->tos); *str != '\0'; ++str)
+            VM_putchar(*str);
         i->tos = *i->sp++;
         break;
     case TRAP_PrintInt:
@@ -278,6 +345,13 @@ static void DoTrap(Interpreter *i, int op)
     case TRAP_PrintFlush:
         VM_flush();
         break;
+    case TRAP_CompileFunction:
+        /* compile the function and continue at its code (the stub is patched to branch there) */
+        if (!i->sys->compileFunction || !(tmp = (*i->sys->compileFunction)(i->sys->compileFunctionCookie, i->tos)))
+            AbortVM(i, "can't compile function");
+        i->tos = Pop(i);
+        i->pc = i->base + tmp;
+        break;
     default:
         AbortVM(i, "undefined print opcode 0x%02x", op);
         break;
@@ -311,8 +385,12 @@ void AbortVM(Interpreter *i, const char *fmt, ...)
     VM_vprintf(fmt, ap);
     VM_printf("\n");
     va_end(ap);
-    if (i)
+    if (i) {
+        int lineNumber = FindImageLine(i->base, i->pc - i->base - 1);
+        if (lineNumber > 0)
+            VM_printf("  line %d\n", lineNumber);
         longjmp(i->errorTarget, 1);
+    }
     else
         exit(1);
 }
@@ -23,6 +23,7 @@ typedef void IntrinsicFcn(Interpreter *i);
 struct Interpreter {
     System *sys;
     uint8_t *base;
+    VMVALUE *constants;
     jmp_buf errorTarget;
     VMVALUE *stack;
     VMVALUE *stackTop;
@@ -61,8 +62,10 @@ struct Interpreter {
 void Fatal(System *sys, const char *fmt, ...);
 
 /* prototypes from db_vmint.c */
-Interpreter *InitInterpreter(System *sys, uint8_t *base, int stackSize);
+Interpreter *InitInterpreter(System *sys, uint8_t *image, int stackSize);
+int RunImage(System *sys, uint8_t *image, int stackSize);
 int Execute(Interpreter *i, VMVALUE mainCode);
+int CallFunction(Interpreter *i, VMVALUE code, int argc, const VMVALUE *argv, VMVALUE *pResult);
 void AbortVM(Interpreter *i, const char *fmt, ...);
 void StackOverflow(Interpreter *i);
 void ShowStack(Interpreter *i);